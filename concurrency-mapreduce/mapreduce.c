@@ -1,9 +1,15 @@
 #include <assert.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+#include <unistd.h>
 #include "mapreduce.h"
 
 /*
@@ -12,7 +18,10 @@
 
   1. Mapping phase
   Create num_mappers threads.
-  Divide work among the threads so that `map` will be called on all elements of argv
+  Divide work among the threads so that `map` will be called on all elements of argv.
+  Threads take the next file from a shared index as they finish the previous one, so one big
+  file doesn't leave the others idle; with `MR_SetLargestFirst` the files are handed out
+  largest-first (by `stat` size) so the big ones don't start last.
   `map` will call `MR_Emit` on all keys/values that need to be reduced.
   `MR_Emit` can be called multiple times with the same key and value - that just means
   an extra copy of that key/value pair should be stored in the key/value pair list.
@@ -20,36 +29,67 @@
   can add any key to any partition because you never know what key map will call MR_Emit with.
   My implentation of the key/value pair list is a an array of num_reducers KVStore structs.
   KVStore structs are basically lockable dynamic arrays of KeyAndValues structs. KeyAndValues structs
-  have a key string and a dynamic arrays of value strings.
+  have a key string and a list of value strings.
+  Key and value strings are copied into a per-partition bump arena instead of being strdup'ed
+  one at a time, and each key's values are a linked list of arena offsets in one shared array
+  of ValueNode structs, so emitting doesn't malloc per value or per key and freeing a store
+  releases all of its strings at once. Offsets are resolved to pointers after the map phase.
   When `MR_Emit` is called, it looks for the key. If it finds it, it adds the value to the list.
   If it doesn't, it adds a new struct with that key and one member of its list (the value).
+  Keys are found through an open-addressing hash table of indexes into the dynamic array, so
+  looking up a key is amortized O(1) instead of a scan over every key in the partition. Each
+  KeyAndValues struct caches the hash of its key so the table can grow without rehashing strings.
   Each KVStore struct must be lockable so that you don't get the same key added twice or a key
   overriding the position of a previous key.
+  To keep mappers off those locks, each mapper thread emits into its own private array of
+  KVStore structs (one per partition). When the thread runs out of files it moves its keys and
+  values into the shared stores in bulk, taking each partition mutex once. With a combiner (see
+  `MR_SetCombiner`) it first runs the combiner over each partition's buffered keys into a fresh
+  private store, and moves that instead.
 
   2. Sorting phase
   Sort the outer array of KeyAndValues structs by key.
   Sort each array of values alphabetically.
+  Partitions are sorted in parallel by the reducer pool (see below) instead of one after
+  another on the main thread. Values are sorted key by key, right before that key is reduced.
+  Both sorts are multikey quicksorts on the strings.
 
   3. Reducing phase
   Reduce is called once per unique key.
   All key/value pairs with the same key are reduced on the same thread.
-  Create num_reducers threads.
+  Create a pool of reducer threads, one per core, independent of num_reducers.
   Divide work among the threads so that `reduce` is called once on all elements of the dynamic
-  array of KeyAndValues structs.
+  array of KeyAndValues structs. Each partition is reduced by one thread in sorted key order;
+  with `MR_SetSplitPartitions` big partitions are split into key ranges instead, so they don't
+  set the wall-clock time on their own.
   `reduce` will call `get_next` to get all the values for a given key until it runs out.
   `get_next` just traverses the dynamic arry in each KeyAndValues struct and returns values.
+  The reducer thread remembers which KeyAndValues struct it is reducing, so `get_next` is O(1)
+  instead of a search through the partition for the key on every call.
 
 */
 
 #define DEFAULT_DYN_ARR_CAPACITY (128)
+#define DEFAULT_TABLE_CAPACITY (256) // must be a power of two
+#define DEFAULT_ARENA_CAPACITY (4096)
+#define EMPTY_SLOT (-1)
+#define END_OF_VALUES (-1)
 
 bool is_verbose = false;
 
+typedef struct ValueNode {
+  size_t offset; // of the value string in the store's arena
+  int next; // index of the key's next value in value_nodes, or END_OF_VALUES
+} ValueNode;
+
 typedef struct KeyAndValues {
-  char *key;
-  char **values;
+  char *key; // points into the store's arena once the map phase is over
+  char **values; // this key's slice of the store's value_ptrs, filled in by prepare_store
+  unsigned long hash; // hash_key(key), cached for growing the table
+  size_t key_offset; // of the key string in the store's arena
+  int first_value; // head and tail of this key's list in value_nodes
+  int last_value;
   int size;
-  int capacity;
   int index; // Used for get_next in the reducing phase.
 } KeyAndValues;
 
@@ -57,21 +97,52 @@ typedef struct KVStore {
   KeyAndValues *key_values_arr;
   int size;
   int capacity;
+  int *table; // open-addressing table of indexes into key_values_arr, EMPTY_SLOT if unused
+  int table_capacity;
+  char *arena; // every key and value string, addressed by offset since the arena moves as it grows
+  size_t arena_size;
+  size_t arena_capacity;
+  ValueNode *value_nodes; // every value, linked into one list per key
+  int num_values;
+  int value_nodes_capacity;
+  char **value_ptrs; // every value, grouped by key, built by prepare_store
+  FILE **runs; // sorted runs spilled to disk when the store went over its memory budget
+  int num_runs;
+  int runs_capacity;
   pthread_mutex_t mutex;
 } KVStore;
 
+typedef struct MapFile {
+  char *file_name;
+  off_t size;
+  int arg_index;
+} MapFile;
+
 KVStore *stores;
 Mapper global_map;
 Reducer global_reduce;
+Combiner global_combine = NULL;
+bool map_largest_first = false;
+bool split_partitions = false; // reduce big partitions as several key ranges at once
+size_t memory_budget = 0; // bytes of intermediate data to hold in memory, 0 for no limit
+int num_map_threads;
 Partitioner global_partition;
 int num_partitions;
 
+MapFile *map_files; // the elements of argv, in the order mappers pick them up
+int num_map_files;
+int next_map_file; // index of the next file to hand to a mapper, taken atomically
+
+MR_Stats stats; // of the last MR_Run, see MR_GetStats
+size_t held_bytes; // held by every store right now, shared and mapper-local
+long lock_wait_nanos;
+
 void print_kv_keys(int partition_num) {
   if (is_verbose) {
     KVStore *kvs_p = &(stores[partition_num]);
     printf("KV store keys:");
     for (int i = 0; i < kvs_p->size; i++) {
-      printf(" %s", kvs_p->key_values_arr[i].key);
+      printf(" %s", kvs_p->arena + kvs_p->key_values_arr[i].key_offset);
     }
     printf("\n");
   }
@@ -83,9 +154,9 @@ void print_kv_state(int partition_num) {
     printf("KV store state %i %i:\n", kvs_p->size, kvs_p->capacity);
     for (int i = 0; i < kvs_p->size; i++) {
       KeyAndValues *kav_p = &(kvs_p->key_values_arr[i]);
-      printf("%s %i %i:", kav_p->key, kav_p->size, kav_p->capacity);
-      for (int j = 0; j < kav_p->size; j++) {
-        printf(" %s", kav_p->values[j]);
+      printf("%s %i:", kvs_p->arena + kav_p->key_offset, kav_p->size);
+      for (int j = kav_p->first_value; j != END_OF_VALUES; j = kvs_p->value_nodes[j].next) {
+        printf(" %s", kvs_p->arena + kvs_p->value_nodes[j].offset);
       }
       printf("\n");
     }
@@ -104,94 +175,858 @@ int compare_by_key(const void *a, const void *b) {
   return strcmp(kva_p->key, kvb_p->key);
 }
 
-int qsort_strcmp(const void* a, const void* b) {
-    const char* aa = *(const char**) a;
-    const char* bb = *(const char**) b;
-    return strcmp(aa,bb);
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// keeps stats.peak_bytes up to date as stores grow and shrink; only called when a store's
+// footprint changes, which is rare next to the number of emits
+void track_bytes(long delta) {
+  size_t held = __atomic_add_fetch(&held_bytes, delta, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&(stats.peak_bytes), __ATOMIC_RELAXED);
+  while (held > peak && !__atomic_compare_exchange_n(&(stats.peak_bytes), &peak, held, true,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// pthread_mutex_lock, timing only the waits: an uncontended lock costs one trylock
+void lock_mutex(pthread_mutex_t *mutex_p) {
+  if (pthread_mutex_trylock(mutex_p) == 0) {
+    return;
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(mutex_p);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long nanos = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+  __atomic_fetch_add(&lock_wait_nanos, nanos, __ATOMIC_RELAXED);
+}
+
+/*
+
+  Multikey quicksort (Bentley & Sedgewick) for arrays of structs whose first member is the
+  string to sort by, so it works on both KeyAndValues structs and arrays of value strings.
+  It partitions on one character at a time instead of calling strcmp on whole strings, so
+  shared prefixes are only looked at once and the inner loop touches one byte per element.
+
+*/
+
+#define INSERTION_SORT_THRESHOLD (16)
+
+static inline char *sort_elem(char *base, int i, size_t width) {
+  return base + (size_t) i * width;
+}
+
+static inline unsigned char char_at(char *base, int i, size_t width, int depth) {
+  return (unsigned char) (*(char **) sort_elem(base, i, width))[depth];
+}
+
+static inline void swap_elems(char *base, int a, int b, size_t width) {
+  char tmp[sizeof(KeyAndValues)];
+  memcpy(tmp, sort_elem(base, a, width), width);
+  memcpy(sort_elem(base, a, width), sort_elem(base, b, width), width);
+  memcpy(sort_elem(base, b, width), tmp, width);
+}
+
+// every string in [lo, hi) shares its first `depth` characters
+void insertion_sort_strings(char *base, int lo, int hi, size_t width, int depth) {
+  for (int i = lo + 1; i < hi; i++) {
+    for (int j = i; j > lo; j--) {
+      char *a = *(char **) sort_elem(base, j - 1, width);
+      char *b = *(char **) sort_elem(base, j, width);
+      if (strcmp(a + depth, b + depth) <= 0) {
+        break;
+      }
+      swap_elems(base, j - 1, j, width);
+    }
+  }
+}
+
+void multikey_qsort_range(char *base, int lo, int hi, size_t width, int depth) {
+  while (hi - lo > INSERTION_SORT_THRESHOLD) {
+    // median of three characters as the pivot
+    int mid = lo + (hi - lo) / 2;
+    unsigned char a = char_at(base, lo, width, depth);
+    unsigned char b = char_at(base, mid, width, depth);
+    unsigned char c = char_at(base, hi - 1, width, depth);
+    unsigned char pivot = (a < b) ? ((b < c) ? b : ((a < c) ? c : a)) : ((a < c) ? a : ((b < c) ? c : b));
+
+    // three-way partition: [lo, lt) < pivot, [lt, gt] == pivot, (gt, hi) > pivot
+    int lt = lo, gt = hi - 1, i = lo;
+    while (i <= gt) {
+      unsigned char ch = char_at(base, i, width, depth);
+      if (ch < pivot) {
+        swap_elems(base, lt++, i++, width);
+      } else if (ch > pivot) {
+        swap_elems(base, i, gt--, width);
+      } else {
+        i++;
+      }
+    }
+
+    multikey_qsort_range(base, lo, lt, width, depth);
+    if (pivot != '\0') {
+      multikey_qsort_range(base, lt, gt + 1, width, depth + 1);
+    }
+    lo = gt + 1;
+  }
+  insertion_sort_strings(base, lo, hi, width, depth);
+}
+
+void multikey_qsort(void *base, int n, size_t width) {
+  assert(width <= sizeof(KeyAndValues));
+  multikey_qsort_range((char *) base, 0, n, width, 0);
+}
+
+// same hash as MR_DefaultHashPartition, before taking the modulus
+unsigned long hash_key(char *key) {
+  unsigned long hash = 5381;
+  int c;
+  while ((c = *key++) != '\0')
+    hash = hash * 33 + c;
+  return hash;
+}
+
+// the low bits of hash_key are correlated with the partition number (every key in a
+// partition has the same hash % num_partitions), so mix the bits before picking a slot
+int table_slot(unsigned long hash, int table_capacity) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdUL;
+  hash ^= hash >> 33;
+  return (int) (hash & (unsigned long) (table_capacity - 1));
+}
+
+void init_table(KVStore *kvs_p, int table_capacity) {
+  kvs_p->table = (int *) malloc(table_capacity * sizeof(int));
+  assert(kvs_p->table != NULL);
+  for (int i = 0; i < table_capacity; i++) {
+    kvs_p->table[i] = EMPTY_SLOT;
+  }
+  kvs_p->table_capacity = table_capacity;
+}
+
+// double the table and reinsert every key using its cached hash
+void grow_table(KVStore *kvs_p) {
+  free(kvs_p->table);
+  init_table(kvs_p, kvs_p->table_capacity * 2);
+  for (int i = 0; i < kvs_p->size; i++) {
+    int slot = table_slot(kvs_p->key_values_arr[i].hash, kvs_p->table_capacity);
+    while (kvs_p->table[slot] != EMPTY_SLOT) {
+      slot = (slot + 1) & (kvs_p->table_capacity - 1);
+    }
+    kvs_p->table[slot] = i;
+  }
+}
+
+// bump-allocates len bytes in the store's arena and returns their offset
+size_t arena_alloc(KVStore *kvs_p, size_t len) {
+  if (kvs_p->arena_size + len > kvs_p->arena_capacity) {
+    while (kvs_p->arena_size + len > kvs_p->arena_capacity) {
+      kvs_p->arena_capacity *= 2;
+    }
+    kvs_p->arena = (char *) realloc(kvs_p->arena, kvs_p->arena_capacity);
+    assert(kvs_p->arena != NULL);
+  }
+  size_t offset = kvs_p->arena_size;
+  kvs_p->arena_size += len;
+  return offset;
+}
+
+size_t arena_strdup(KVStore *kvs_p, char *str) {
+  size_t len = strlen(str) + 1;
+  size_t offset = arena_alloc(kvs_p, len);
+  memcpy(kvs_p->arena + offset, str, len);
+  return offset;
+}
+
+// make room for at least `extra` more value nodes
+void reserve_value_nodes(KVStore *kvs_p, int extra) {
+  if (kvs_p->num_values + extra > kvs_p->value_nodes_capacity) {
+    while (kvs_p->num_values + extra > kvs_p->value_nodes_capacity) {
+      kvs_p->value_nodes_capacity *= 2;
+    }
+    kvs_p->value_nodes = (ValueNode *) realloc(kvs_p->value_nodes, kvs_p->value_nodes_capacity * sizeof(ValueNode));
+    assert(kvs_p->value_nodes != NULL);
+  }
+}
+
+// returns the index of key in key_values_arr, or EMPTY_SLOT with *slot_p set to the table
+// slot where the key belongs
+int find_key(KVStore *kvs_p, char *key, unsigned long hash, int *slot_p) {
+  int slot = table_slot(hash, kvs_p->table_capacity);
+  while (kvs_p->table[slot] != EMPTY_SLOT) {
+    KeyAndValues *kav_p = &(kvs_p->key_values_arr[kvs_p->table[slot]]);
+    if (kav_p->hash == hash && strcmp(key, kvs_p->arena + kav_p->key_offset) == 0) {
+      return kvs_p->table[slot];
+    }
+    slot = (slot + 1) & (kvs_p->table_capacity - 1);
+  }
+  *slot_p = slot;
+  return EMPTY_SLOT;
+}
+
+// copies *new_kav_p into the store at the slot returned by find_key
+int insert_key(KVStore *kvs_p, KeyAndValues *new_kav_p, int slot) {
+  if (kvs_p->size == kvs_p->capacity) {
+    kvs_p->key_values_arr = (KeyAndValues *) realloc(kvs_p->key_values_arr, kvs_p->capacity * 2 * sizeof(KeyAndValues));
+    assert(kvs_p->key_values_arr != NULL);
+    kvs_p->capacity *= 2;
+  }
+  int key_index = kvs_p->size;
+  kvs_p->key_values_arr[key_index] = *new_kav_p;
+  kvs_p->size++;
+  kvs_p->table[slot] = key_index;
+
+  // keep the load factor at or below 1/2 so probe sequences stay short
+  if (kvs_p->size * 2 > kvs_p->table_capacity) {
+    grow_table(kvs_p);
+  }
+  return key_index;
+}
+
+// returns the index of key in key_values_arr, adding a new KeyAndValues struct if needed
+int find_or_add_key(KVStore *kvs_p, char *key) {
+  unsigned long hash = hash_key(key);
+  int slot;
+  int key_index = find_key(kvs_p, key, hash, &slot);
+  if (key_index != EMPTY_SLOT) {
+    return key_index;
+  }
+
+  // add a new KeyAndValues struct for this key
+  KeyAndValues kav;
+  kav.key = NULL;
+  kav.values = NULL;
+  kav.hash = hash;
+  kav.key_offset = arena_strdup(kvs_p, key);
+  kav.first_value = END_OF_VALUES;
+  kav.last_value = END_OF_VALUES;
+  kav.size = 0;
+  kav.index = 0;
+  return insert_key(kvs_p, &kav, slot);
+}
+
+void add_value(KVStore *kvs_p, char *key, char *value) {
+  int key_index = find_or_add_key(kvs_p, key); // may realloc key_values_arr
+  reserve_value_nodes(kvs_p, 1);
+  int node = kvs_p->num_values++;
+  kvs_p->value_nodes[node].offset = arena_strdup(kvs_p, value);
+  kvs_p->value_nodes[node].next = END_OF_VALUES;
+
+  KeyAndValues *kav_p = &(kvs_p->key_values_arr[key_index]);
+  if (kav_p->last_value == END_OF_VALUES) {
+    kav_p->first_value = node;
+  } else {
+    kvs_p->value_nodes[kav_p->last_value].next = node;
+  }
+  kav_p->last_value = node;
+  kav_p->size++;
+}
+
+// bytes of memory the store's data is holding
+size_t store_bytes(KVStore *kvs_p) {
+  return kvs_p->arena_capacity
+    + (size_t) kvs_p->capacity * sizeof(KeyAndValues)
+    + (size_t) kvs_p->table_capacity * sizeof(int)
+    + (size_t) kvs_p->value_nodes_capacity * sizeof(ValueNode);
+}
+
+void init_store_data(KVStore *kvs_p) {
+  kvs_p->key_values_arr = (KeyAndValues *) malloc(DEFAULT_DYN_ARR_CAPACITY * sizeof(KeyAndValues));
+  assert(kvs_p->key_values_arr != NULL);
+  kvs_p->size = 0;
+  kvs_p->capacity = DEFAULT_DYN_ARR_CAPACITY;
+  init_table(kvs_p, DEFAULT_TABLE_CAPACITY);
+  kvs_p->arena = (char *) malloc(DEFAULT_ARENA_CAPACITY);
+  assert(kvs_p->arena != NULL);
+  kvs_p->arena_size = 0;
+  kvs_p->arena_capacity = DEFAULT_ARENA_CAPACITY;
+  kvs_p->value_nodes = (ValueNode *) malloc(DEFAULT_DYN_ARR_CAPACITY * sizeof(ValueNode));
+  assert(kvs_p->value_nodes != NULL);
+  kvs_p->num_values = 0;
+  kvs_p->value_nodes_capacity = DEFAULT_DYN_ARR_CAPACITY;
+  kvs_p->value_ptrs = NULL;
+  track_bytes(store_bytes(kvs_p));
+}
+
+void init_store(KVStore *kvs_p) {
+  init_store_data(kvs_p);
+  kvs_p->runs = NULL;
+  kvs_p->num_runs = 0;
+  kvs_p->runs_capacity = 0;
+  pthread_mutex_init(&(kvs_p->mutex), NULL);
+}
+
+// every string lives in the arena, so this releases all of the store's data at once
+void free_store_data(KVStore *kvs_p) {
+  track_bytes(-(long) store_bytes(kvs_p));
+  free(kvs_p->key_values_arr);
+  free(kvs_p->table);
+  free(kvs_p->arena);
+  free(kvs_p->value_nodes);
+  free(kvs_p->value_ptrs);
+}
+
+void free_store(KVStore *kvs_p) {
+  free_store_data(kvs_p);
+  for (int i = 0; i < kvs_p->num_runs; i++) {
+    fclose(kvs_p->runs[i]);
+  }
+  free(kvs_p->runs);
+  pthread_mutex_destroy(&(kvs_p->mutex));
+}
+
+// Once the map phase is over the arena stops moving: point each key at its string and
+// gather each key's values into one contiguous slice of value_ptrs for sorting and get_next.
+void prepare_store(KVStore *kvs_p) {
+  kvs_p->value_ptrs = (char **) malloc((kvs_p->num_values + 1) * sizeof(char *));
+  assert(kvs_p->value_ptrs != NULL);
+  char **next_ptr = kvs_p->value_ptrs;
+  for (int i = 0; i < kvs_p->size; i++) {
+    KeyAndValues *kav_p = &(kvs_p->key_values_arr[i]);
+    kav_p->key = kvs_p->arena + kav_p->key_offset;
+    kav_p->values = next_ptr;
+    for (int j = kav_p->first_value; j != END_OF_VALUES; j = kvs_p->value_nodes[j].next) {
+      *next_ptr++ = kvs_p->arena + kvs_p->value_nodes[j].offset;
+    }
+    kav_p->index = 0;
+  }
+  free(kvs_p->value_nodes);
+  kvs_p->value_nodes = NULL;
 }
 
 void init_stores() {
   stores = (KVStore *) malloc(num_partitions * sizeof(KVStore));
   assert(stores != NULL);
   for (int i = 0; i < num_partitions; i++) {
-    KVStore *kvs_p = &(stores[i]);
-    kvs_p->key_values_arr = (KeyAndValues *) malloc(DEFAULT_DYN_ARR_CAPACITY * sizeof(KeyAndValues));
-    assert(kvs_p->key_values_arr != NULL);
-    kvs_p->size = 0;
-    kvs_p->capacity = DEFAULT_DYN_ARR_CAPACITY;
-    pthread_mutex_init(&(kvs_p->mutex), NULL);
+    init_store(&(stores[i]));
   }
 }
 
 void free_stores() {
   for (int i = 0; i < num_partitions; i++) {
-    KVStore *kvs_p = &(stores[i]);
-    for (int j = 0; j < kvs_p->size; j++) {
-      KeyAndValues *kav_p = &(kvs_p->key_values_arr[j]);
-      free(kav_p->key);
-      for (int k = 0; k < kav_p->size; k++) {
-        free(kav_p->values[k]);
+    free_store(&(stores[i]));
+  }
+  free(stores);
+}
+
+/*
+
+  Spilling to disk
+
+  With a memory budget (see `MR_SetMemoryBudget`), half of it is shared by the mappers'
+  private buffers and half by the partition stores. A mapper whose buffers go over its
+  share flushes them into the partition stores early, and a partition store that goes over
+  its share is sorted and written out as a run to an unlinked temp file, then emptied.
+
+  A run is a sequence of records, in key order:
+    [uint32 key length][key bytes][uint32 number of values]
+    then for each value, in order: [uint32 value length][value bytes]
+
+  When a partition has MAX_RUNS runs they are merged into one, to bound open files and the
+  fan-in of the final merge. A partition with runs spills whatever is left in memory as one
+  more run when its reducer starts, then the reducer streams the partition back with a k-way merge of its runs: a heap
+  picks the smallest key, and get_next returns the smallest value among the runs holding that
+  key. Values from get_next are then only valid until the next get_next call.
+
+*/
+
+#define RUN_BUFFER_SIZE (1 << 16)
+#define MAX_RUNS (64) // merge a partition's runs into one when it has this many
+#ifndef MIN_SPILL_BYTES
+#define MIN_SPILL_BYTES (1 << 20) // never spill or flush early below this, however small the budget
+#endif
+
+void write_bytes(FILE *file, void *data, size_t len) {
+  if (len > 0 && fwrite(data, len, 1, file) != 1) {
+    perror("mapreduce: spill write failed");
+    exit(1);
+  }
+}
+
+void write_string(FILE *file, char *str) {
+  uint32_t len = strlen(str);
+  write_bytes(file, &len, sizeof(len));
+  write_bytes(file, str, len);
+}
+
+// a temp file that is gone as soon as it's closed
+FILE *open_run_file() {
+  char *dir = getenv("TMPDIR");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/mapreduce-run-XXXXXX", dir != NULL ? dir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror("mapreduce: cannot create spill file");
+    exit(1);
+  }
+  unlink(path);
+  FILE *file = fdopen(fd, "w+");
+  assert(file != NULL);
+  setvbuf(file, NULL, _IOFBF, RUN_BUFFER_SIZE);
+  return file;
+}
+
+void compact_runs(KVStore *kvs_p);
+
+// sorts the store's keys and every key's values, and writes them out as a new run
+void spill_store(KVStore *kvs_p) {
+  prepare_store(kvs_p);
+  multikey_qsort(kvs_p->key_values_arr, kvs_p->size, sizeof(KeyAndValues));
+  FILE *file = open_run_file();
+  for (int i = 0; i < kvs_p->size; i++) {
+    KeyAndValues *kav_p = &(kvs_p->key_values_arr[i]);
+    multikey_qsort(kav_p->values, kav_p->size, sizeof(char *));
+    write_string(file, kav_p->key);
+    uint32_t num_values = kav_p->size;
+    write_bytes(file, &num_values, sizeof(num_values));
+    for (int j = 0; j < kav_p->size; j++) {
+      write_string(file, kav_p->values[j]);
+    }
+  }
+  fflush(file);
+
+  if (kvs_p->num_runs == kvs_p->runs_capacity) {
+    kvs_p->runs_capacity = kvs_p->runs_capacity == 0 ? 8 : kvs_p->runs_capacity * 2;
+    kvs_p->runs = (FILE **) realloc(kvs_p->runs, kvs_p->runs_capacity * sizeof(FILE *));
+    assert(kvs_p->runs != NULL);
+  }
+  kvs_p->runs[kvs_p->num_runs++] = file;
+  if (is_verbose) {
+    printf("Spilled run %i: %i keys\n", kvs_p->num_runs, kvs_p->size);
+  }
+
+  free_store_data(kvs_p);
+  init_store_data(kvs_p);
+  if (kvs_p->num_runs == MAX_RUNS) {
+    compact_runs(kvs_p);
+  }
+}
+
+// the share of the budget each of `count` holders gets
+size_t budget_share(int count) {
+  size_t share = memory_budget / 2 / count;
+  return share < MIN_SPILL_BYTES ? MIN_SPILL_BYTES : share;
+}
+
+// called with the store's mutex held after anything is added to a shared store
+void maybe_spill(KVStore *kvs_p) {
+  if (memory_budget > 0 && store_bytes(kvs_p) > budget_share(num_partitions)) {
+    spill_store(kvs_p);
+  }
+}
+
+typedef struct RunReader {
+  FILE *file;
+  char *key; // current key, valid while has_key
+  size_t key_capacity;
+  char *value; // current value of the current key, valid while has_value
+  size_t value_capacity;
+  uint32_t values_left; // values of the current key not read yet
+  bool has_key;
+  bool has_value;
+} RunReader;
+
+typedef struct RunMerger {
+  RunReader *readers;
+  int num_readers;
+  int *heap; // readers that have a key, as a min-heap by key
+  int heap_size;
+  int *active; // readers holding values for the key being reduced
+  int num_active;
+  char *key; // the key being reduced
+  size_t key_capacity;
+  char *value; // the value last returned by get_next
+  size_t value_capacity;
+} RunMerger;
+
+void read_bytes(FILE *file, void *data, size_t len) {
+  if (len > 0 && fread(data, len, 1, file) != 1) {
+    fprintf(stderr, "mapreduce: spill file truncated\n");
+    exit(1);
+  }
+}
+
+void ensure_capacity(char **buf_p, size_t *capacity_p, size_t len) {
+  if (len > *capacity_p) {
+    *capacity_p = len * 2;
+    *buf_p = (char *) realloc(*buf_p, *capacity_p);
+    assert(*buf_p != NULL);
+  }
+}
+
+// reads a string into *buf_p, growing it as needed; returns false at the end of the file
+bool read_string(FILE *file, char **buf_p, size_t *capacity_p) {
+  uint32_t len;
+  if (fread(&len, sizeof(len), 1, file) != 1) {
+    return false;
+  }
+  ensure_capacity(buf_p, capacity_p, len + 1);
+  read_bytes(file, *buf_p, len);
+  (*buf_p)[len] = '\0';
+  return true;
+}
+
+void reader_next_value(RunReader *reader_p) {
+  reader_p->has_value = reader_p->values_left > 0;
+  if (reader_p->has_value) {
+    read_string(reader_p->file, &(reader_p->value), &(reader_p->value_capacity));
+    reader_p->values_left--;
+  }
+}
+
+// skips the rest of the current key's values and moves to the next key
+void reader_next_key(RunReader *reader_p) {
+  while (reader_p->values_left > 0) {
+    uint32_t len;
+    read_bytes(reader_p->file, &len, sizeof(len));
+    fseek(reader_p->file, len, SEEK_CUR);
+    reader_p->values_left--;
+  }
+  reader_p->has_value = false;
+  reader_p->has_key = read_string(reader_p->file, &(reader_p->key), &(reader_p->key_capacity));
+  if (reader_p->has_key) {
+    read_bytes(reader_p->file, &(reader_p->values_left), sizeof(uint32_t));
+  }
+}
+
+bool reader_less(RunMerger *merger_p, int a, int b) {
+  return strcmp(merger_p->readers[a].key, merger_p->readers[b].key) < 0;
+}
+
+void heap_push(RunMerger *merger_p, int reader) {
+  int i = merger_p->heap_size++;
+  while (i > 0 && reader_less(merger_p, reader, merger_p->heap[(i - 1) / 2])) {
+    merger_p->heap[i] = merger_p->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  merger_p->heap[i] = reader;
+}
+
+int heap_pop(RunMerger *merger_p) {
+  int top = merger_p->heap[0];
+  int last = merger_p->heap[--merger_p->heap_size];
+  int i = 0;
+  while (2 * i + 1 < merger_p->heap_size) {
+    int child = 2 * i + 1;
+    if (child + 1 < merger_p->heap_size && reader_less(merger_p, merger_p->heap[child + 1], merger_p->heap[child])) {
+      child++;
+    }
+    if (!reader_less(merger_p, merger_p->heap[child], last)) {
+      break;
+    }
+    merger_p->heap[i] = merger_p->heap[child];
+    i = child;
+  }
+  merger_p->heap[i] = last;
+  return top;
+}
+
+// the next value for the key being reduced, smallest first across the active runs
+char *get_next_merged(RunMerger *merger_p) {
+  RunReader *min_p = NULL;
+  for (int i = 0; i < merger_p->num_active; i++) {
+    RunReader *reader_p = &(merger_p->readers[merger_p->active[i]]);
+    if (reader_p->has_value && (min_p == NULL || strcmp(reader_p->value, min_p->value) < 0)) {
+      min_p = reader_p;
+    }
+  }
+  if (min_p == NULL) {
+    return NULL;
+  }
+  // hand the reader's buffer to the caller and read the run's next value into ours
+  char *value = min_p->value;
+  size_t value_capacity = min_p->value_capacity;
+  min_p->value = merger_p->value;
+  min_p->value_capacity = merger_p->value_capacity;
+  merger_p->value = value;
+  merger_p->value_capacity = value_capacity;
+  reader_next_value(min_p);
+  return merger_p->value;
+}
+
+// The merge of the partition being reduced on this thread, if that partition spilled.
+__thread RunMerger *reduce_merger_p = NULL;
+
+char *get_next(char *key, int partition_number);
+
+// Merges a partition's runs: calls `reduce` once per key, or if out is not NULL writes
+// the merged records to out as a single run instead.
+void merge_runs(KVStore *kvs_p, int partition_number, FILE *out) {
+  RunMerger merger;
+  merger.num_readers = kvs_p->num_runs;
+  merger.readers = (RunReader *) calloc(merger.num_readers, sizeof(RunReader));
+  merger.heap = (int *) malloc(merger.num_readers * sizeof(int));
+  merger.active = (int *) malloc(merger.num_readers * sizeof(int));
+  assert(merger.readers != NULL && merger.heap != NULL && merger.active != NULL);
+  merger.heap_size = 0;
+  merger.key = NULL;
+  merger.key_capacity = 0;
+  merger.value = NULL;
+  merger.value_capacity = 0;
+  for (int i = 0; i < merger.num_readers; i++) {
+    merger.readers[i].file = kvs_p->runs[i];
+    rewind(kvs_p->runs[i]);
+    reader_next_key(&(merger.readers[i]));
+    if (merger.readers[i].has_key) {
+      heap_push(&merger, i);
+    }
+  }
+
+  if (out == NULL) {
+    reduce_merger_p = &merger;
+  }
+  while (merger.heap_size > 0) {
+    // every run whose current key is the smallest takes part in this reduce
+    RunReader *first_p = &(merger.readers[merger.heap[0]]);
+    ensure_capacity(&(merger.key), &(merger.key_capacity), strlen(first_p->key) + 1);
+    strcpy(merger.key, first_p->key);
+    merger.num_active = 0;
+    while (merger.heap_size > 0 && strcmp(merger.readers[merger.heap[0]].key, merger.key) == 0) {
+      int reader = heap_pop(&merger);
+      merger.active[merger.num_active++] = reader;
+      reader_next_value(&(merger.readers[reader]));
+    }
+
+    if (out == NULL) {
+      stats.unique_keys[partition_number]++;
+      global_reduce(merger.key, get_next, partition_number);
+    } else {
+      write_string(out, merger.key);
+      uint32_t num_values = 0;
+      for (int i = 0; i < merger.num_active; i++) {
+        num_values += merger.readers[merger.active[i]].values_left + 1;
+      }
+      write_bytes(out, &num_values, sizeof(num_values));
+      char *value;
+      while ((value = get_next_merged(&merger)) != NULL) {
+        write_string(out, value);
+      }
+    }
+
+    for (int i = 0; i < merger.num_active; i++) {
+      reader_next_key(&(merger.readers[merger.active[i]]));
+      if (merger.readers[merger.active[i]].has_key) {
+        heap_push(&merger, merger.active[i]);
       }
-      free(kav_p->values);
     }
-    free(kvs_p->key_values_arr);
   }
-  free(stores);
+  reduce_merger_p = NULL;
+
+  for (int i = 0; i < merger.num_readers; i++) {
+    free(merger.readers[i].key);
+    free(merger.readers[i].value);
+  }
+  free(merger.readers);
+  free(merger.heap);
+  free(merger.active);
+  free(merger.key);
+  free(merger.value);
+}
+
+void compact_runs(KVStore *kvs_p) {
+  FILE *file = open_run_file();
+  merge_runs(kvs_p, -1, file);
+  fflush(file);
+  for (int i = 0; i < kvs_p->num_runs; i++) {
+    fclose(kvs_p->runs[i]);
+  }
+  kvs_p->runs[0] = file;
+  kvs_p->num_runs = 1;
+}
+
+// Mapper threads buffer their emits in private per-partition stores so the map phase
+// never touches the shared partition mutexes. NULL outside of mapper threads (and while
+// a mapper is flushing its buffers), in which case MR_Emit goes straight to `stores`.
+// A partition's buffer is only set up on the thread's first emit to it (key_values_arr is
+// NULL until then), so many partitions don't cost every mapper a buffer each.
+__thread KVStore *local_stores = NULL;
+__thread size_t local_bytes = 0; // added to this thread's local_stores since they were set up
+__thread int local_thread_index;
+
+void init_local_stores() {
+  local_stores = (KVStore *) malloc(num_partitions * sizeof(KVStore));
+  assert(local_stores != NULL);
+  local_bytes = 0;
+  for (int i = 0; i < num_partitions; i++) {
+    local_stores[i].key_values_arr = NULL;
+  }
 }
 
+// Getter handed to the combiner; the cursor is set by combine_local_store and walks the
+// key's list in value_nodes
+__thread KVStore *combine_store_p = NULL;
+__thread KeyAndValues *combine_kav_p = NULL;
+
+// The combiner's output for the partition being combined: a fresh private store that
+// goes into the shared store in one merge_local_store, so combining takes each partition
+// mutex once. A combiner that emits a key of some other partition goes to the shared store.
+__thread KVStore *combine_out_p = NULL;
+__thread int combine_partition;
+
+void flush_local_stores();
+
 void MR_Emit(char *key, char *value) {
   int partition_num = global_partition(key, num_partitions);
+  if (combine_out_p != NULL && partition_num == combine_partition) {
+    size_t bytes_before = store_bytes(combine_out_p);
+    add_value(combine_out_p, key, value);
+    track_bytes(store_bytes(combine_out_p) - bytes_before);
+    return;
+  }
+  if (local_stores != NULL) {
+    KVStore *local_p = &(local_stores[partition_num]);
+    if (local_p->key_values_arr == NULL) {
+      init_store(local_p);
+    }
+    size_t bytes_before = store_bytes(local_p);
+    add_value(local_p, key, value);
+    size_t bytes_added = store_bytes(local_p) - bytes_before;
+    if (bytes_added > 0) {
+      local_bytes += bytes_added;
+      track_bytes(bytes_added);
+    }
+    // only what the emits added counts against the share, not the empty buffers, so a
+    // flush leaves nothing that could set off another one right away
+    if (memory_budget > 0 && local_bytes > budget_share(num_map_threads)) {
+      flush_local_stores();
+      init_local_stores();
+    }
+    return;
+  }
+
   KVStore *kvs_p = &(stores[partition_num]);
+  lock_mutex(&(kvs_p->mutex));
+  size_t bytes_before = store_bytes(kvs_p);
+  add_value(kvs_p, key, value);
+  track_bytes(store_bytes(kvs_p) - bytes_before);
+  if (combine_store_p == NULL) {
+    // a combiner's emits were already counted when the mapper emitted them; atomic, since
+    // flush_local_stores adds to the same count without this partition's lock
+    __atomic_fetch_add(&(stats.emits[partition_num]), 1, __ATOMIC_RELAXED);
+  }
+  maybe_spill(kvs_p);
+  pthread_mutex_unlock(&(kvs_p->mutex));
+}
 
-  pthread_mutex_lock(&(kvs_p->mutex));
-  int key_index = -1;
-  for (int i = 0; i < kvs_p->size; i++) {
-    if (strcmp(key, kvs_p->key_values_arr[i].key) == 0) {
-      key_index = i;
-      break;
+char *get_next_combine(char *key) {
+  assert(combine_kav_p != NULL);
+  if (combine_kav_p->index == END_OF_VALUES) {
+    return NULL;
+  }
+  ValueNode *node_p = &(combine_store_p->value_nodes[combine_kav_p->index]);
+  combine_kav_p->index = node_p->next;
+  return combine_store_p->arena + node_p->offset;
+}
+
+void merge_local_store(KVStore *local_p, KVStore *kvs_p);
+
+// runs the combiner over every key in a mapper's buffer for one partition, collecting
+// what it emits in combine_out_p and merging that into the shared store in bulk
+void combine_local_store(KVStore *local_p, int partition_num) {
+  KVStore combined;
+  init_store(&combined);
+  combine_out_p = &combined;
+  combine_partition = partition_num;
+  combine_store_p = local_p;
+  for (int i = 0; i < local_p->size; i++) {
+    KeyAndValues *kav_p = &(local_p->key_values_arr[i]);
+    kav_p->index = kav_p->first_value;
+    combine_kav_p = kav_p;
+    global_combine(local_p->arena + kav_p->key_offset, get_next_combine);
+  }
+  combine_kav_p = NULL;
+  combine_store_p = NULL;
+  combine_out_p = NULL;
+  merge_local_store(&combined, &(stores[partition_num]));
+  free_store(&combined);
+}
+
+// moves every key and value in a mapper's buffer into the shared store, taking the
+// partition mutex once for the whole buffer: the buffer's arena and value nodes are
+// appended wholesale and its offsets and indexes rebased, then each key's list is
+// either inserted as a new key or spliced onto the end of the existing key's list
+void merge_local_store(KVStore *local_p, KVStore *kvs_p) {
+  lock_mutex(&(kvs_p->mutex));
+  size_t bytes_before = store_bytes(kvs_p);
+  size_t arena_base = arena_alloc(kvs_p, local_p->arena_size);
+  memcpy(kvs_p->arena + arena_base, local_p->arena, local_p->arena_size);
+
+  int node_base = kvs_p->num_values;
+  reserve_value_nodes(kvs_p, local_p->num_values);
+  for (int i = 0; i < local_p->num_values; i++) {
+    ValueNode *node_p = &(kvs_p->value_nodes[node_base + i]);
+    node_p->offset = local_p->value_nodes[i].offset + arena_base;
+    node_p->next = local_p->value_nodes[i].next;
+    if (node_p->next != END_OF_VALUES) {
+      node_p->next += node_base;
     }
   }
+  kvs_p->num_values += local_p->num_values;
 
-  if (key_index == -1) {
-    // add a new KeyAndValues struct for this key
-    if (kvs_p->size == kvs_p->capacity) {
-      kvs_p->key_values_arr = (KeyAndValues *) realloc(kvs_p->key_values_arr, kvs_p->capacity * 2 * sizeof(KeyAndValues));
-      assert(kvs_p->key_values_arr != NULL);
-      kvs_p->capacity *= 2;
+  for (int i = 0; i < local_p->size; i++) {
+    KeyAndValues local_kav = local_p->key_values_arr[i];
+    local_kav.key_offset += arena_base;
+    local_kav.first_value += node_base;
+    local_kav.last_value += node_base;
+    int slot;
+    int key_index = find_key(kvs_p, kvs_p->arena + local_kav.key_offset, local_kav.hash, &slot);
+    if (key_index == EMPTY_SLOT) {
+      insert_key(kvs_p, &local_kav, slot);
+      continue;
     }
-    KeyAndValues *kav_p = &(kvs_p->key_values_arr[kvs_p->size]);
-    kav_p->key = strdup(key);
-    assert(kav_p->key != NULL);
-    kav_p->values = (char **) malloc(DEFAULT_DYN_ARR_CAPACITY * sizeof(char *)),
-    assert(kav_p->values != NULL);
-    kav_p->values[0] = strdup(value);
-    assert(kav_p->values[0] != NULL);
-    kav_p->size = 1;
-    kav_p->capacity = DEFAULT_DYN_ARR_CAPACITY;
-    kav_p->index = 0;
-    kvs_p->size++;
-  } else {
-    // add this value to an existing KeyAndValues struct's values array
     KeyAndValues *kav_p = &(kvs_p->key_values_arr[key_index]);
-    if (kav_p->size == kav_p->capacity) {
-      kav_p->values = (char **) realloc(kav_p->values, kav_p->capacity * 2 * sizeof(char *));
-      assert(kav_p->values != NULL);
-      kav_p->capacity *= 2;
-    }
-    kav_p->values[kav_p->size] = strdup(value);
-    kav_p->size++;
+    kvs_p->value_nodes[kav_p->last_value].next = local_kav.first_value;
+    kav_p->last_value = local_kav.last_value;
+    kav_p->size += local_kav.size;
   }
+  track_bytes(store_bytes(kvs_p) - bytes_before);
+  maybe_spill(kvs_p);
   pthread_mutex_unlock(&(kvs_p->mutex));
 }
 
+// empties the calling mapper thread's buffers into the shared stores
+void flush_local_stores() {
+  int thread_index = local_thread_index;
+  KVStore *buffers = local_stores;
+  local_stores = NULL;
+  // start at a different partition in each thread so mappers that finish together
+  // don't queue up on the same mutex
+  for (int i = 0; i < num_partitions; i++) {
+    int partition_num = (thread_index + i) % num_partitions;
+    KVStore *local_p = &(buffers[partition_num]);
+    if (local_p->key_values_arr == NULL) {
+      continue; // nothing was emitted to it
+    }
+    __atomic_fetch_add(&(stats.emits[partition_num]), local_p->num_values, __ATOMIC_RELAXED);
+    if (global_combine != NULL) {
+      combine_local_store(local_p, partition_num);
+    } else {
+      merge_local_store(local_p, &(stores[partition_num]));
+    }
+    free_store(local_p);
+  }
+  free(buffers);
+}
+
+// The KeyAndValues struct of the key currently being reduced on this thread, set by
+// run_reduce_task around each call to `reduce` so get_next doesn't search for the key.
+__thread KeyAndValues *reduce_kav_p = NULL;
+
 // no need for locking here since each key is only used by one reducing thread
 char *get_next(char *key, int partition_number) {
-  KVStore *kvs_p = &(stores[partition_number]);
-  KeyAndValues *kav_p = NULL;
-  for (int i = 0; i < kvs_p->size; i++) {
-    if (strcmp(key, kvs_p->key_values_arr[i].key) == 0) {
-      kav_p = &(kvs_p->key_values_arr[i]);
-    }
+  if (reduce_merger_p != NULL) {
+    return get_next_merged(reduce_merger_p);
+  }
+  KeyAndValues *kav_p = reduce_kav_p;
+  if (kav_p == NULL || (kav_p->key != key && strcmp(key, kav_p->key) != 0)) {
+    // asked for some other key: the partition is sorted by now, so binary search for it
+    KVStore *kvs_p = &(stores[partition_number]);
+    KeyAndValues target;
+    target.key = key;
+    kav_p = (KeyAndValues *) bsearch(&target, kvs_p->key_values_arr, kvs_p->size, sizeof(KeyAndValues), &compare_by_key);
   }
   assert(kav_p != NULL);
   if (kav_p->index == kav_p->size) {
@@ -200,36 +1035,233 @@ char *get_next(char *key, int partition_number) {
   return kav_p->values[kav_p->index++];
 }
 
+void MR_SetCombiner(Combiner combine) {
+  global_combine = combine;
+}
+
+void MR_SetLargestFirst(int enabled) {
+  map_largest_first = enabled;
+}
+
+void MR_SetSplitPartitions(int enabled) {
+  split_partitions = enabled;
+}
+
+void MR_SetMemoryBudget(size_t bytes) {
+  memory_budget = bytes;
+}
+
+MR_Stats *MR_GetStats(void) {
+  return &stats;
+}
+
 unsigned long MR_DefaultHashPartition(char *key, int num_partitions) {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *key++) != '\0')
-        hash = hash * 33 + c;
-    return hash % num_partitions;
+    return hash_key(key) % num_partitions;
+}
+
+// largest file first, ties in argv order
+int compare_by_size_desc(const void *a, const void *b) {
+  MapFile *mfa_p = (MapFile *) a;
+  MapFile *mfb_p = (MapFile *) b;
+  if (mfa_p->size != mfb_p->size) {
+    return mfa_p->size < mfb_p->size ? 1 : -1;
+  }
+  return mfa_p->arg_index - mfb_p->arg_index;
+}
+
+// builds the list of files mappers pull from, optionally sorted largest-first so a big
+// file doesn't start last and leave every other mapper idle
+void init_map_files(int argc, char *argv[]) {
+  num_map_files = argc - 1;
+  map_files = (MapFile *) malloc(num_map_files * sizeof(MapFile));
+  assert(map_files != NULL);
+  for (int i = 0; i < num_map_files; i++) {
+    map_files[i].file_name = argv[i + 1];
+    map_files[i].arg_index = i + 1;
+    map_files[i].size = 0;
+    struct stat st;
+    if (map_largest_first && stat(argv[i + 1], &st) == 0) {
+      map_files[i].size = st.st_size;
+    }
+  }
+  if (map_largest_first) {
+    qsort(map_files, num_map_files, sizeof(MapFile), &compare_by_size_desc);
+  }
+  next_map_file = 0;
 }
 
 typedef struct MapThreadArgs {
-  char** argv;
-  int start_index;
-  int end_index;
+  int thread_index;
 } MapThreadArgs;
 
 void *map_thread_func(void *map_thread_args_void) {
   MapThreadArgs *args_p = (MapThreadArgs *) map_thread_args_void; 
-  if (is_verbose) {
-    printf("map_thread_args %i %i\n", args_p->start_index, args_p->end_index);
-  }
-  for (int i = args_p->start_index; i < args_p->end_index; i++) {
-    global_map(args_p->argv[i]);
+  local_thread_index = args_p->thread_index;
+  init_local_stores();
+  // pull files off the shared list until it runs out, so a thread that drew a big
+  // file doesn't hold up files the other threads could be mapping
+  int i;
+  while ((i = __atomic_fetch_add(&next_map_file, 1, __ATOMIC_RELAXED)) < num_map_files) {
+    if (is_verbose) {
+      printf("map_thread %i mapping %s\n", args_p->thread_index, map_files[i].file_name);
+    }
+    global_map(map_files[i].file_name);
   }
+  flush_local_stores();
   return NULL;
 }
 
-void *reduce_thread_func(void *partition_num_void) {
-  int *partition_num_p = (int *) partition_num_void;
-  KVStore *kvs_p = &(stores[*partition_num_p]);
-  for (int i = 0; i < kvs_p->size; i++) {
-    global_reduce(kvs_p->key_values_arr[i].key, get_next, *partition_num_p);
+/*
+
+  The reducer pool
+
+  The sort and reduce phases run on a pool of get_nprocs() threads, however many partitions
+  there are. In the sort stage each thread takes the biggest partition nobody has started
+  yet and sorts its keys (a partition that spilled writes its last run instead). Once every
+  partition is sorted, the partitions are cut into ReduceTasks, one per partition. With
+  `MR_SetSplitPartitions` a partition with more values than a fair share of the work is split
+  into ranges of keys instead, so one hot partition can be reduced by several threads at once.
+  The reduce stage then hands out tasks biggest first.
+  A key's values are sorted right before it is reduced so they're still in cache when
+  get_next hands them out.
+
+*/
+
+#define TASKS_PER_THREAD (4) // split partitions finer than one task per thread, for balance
+#define MIN_TASK_VALUES (1024) // but don't bother splitting below this
+
+typedef struct ReduceTask {
+  int partition_num;
+  int first_key; // range of keys in the partition's sorted key_values_arr
+  int end_key;
+  long num_values; // how much work the task is, for scheduling biggest first
+} ReduceTask;
+
+int num_pool_threads;
+int *sort_order; // partitions, biggest first
+int next_sort; // index into sort_order of the next partition to sort, taken atomically
+ReduceTask *reduce_tasks;
+int num_reduce_tasks;
+int reduce_tasks_capacity;
+int next_reduce_task; // taken atomically
+pthread_barrier_t pool_barrier;
+double sort_end_time;
+
+long partition_values(int partition_num) {
+  KVStore *kvs_p = &(stores[partition_num]);
+  // a spilled partition goes first: it has the most data and has to come back from disk
+  return kvs_p->num_runs > 0 ? __LONG_MAX__ : kvs_p->num_values;
+}
+
+// biggest first
+int compare_partitions(const void *a, const void *b) {
+  long a_values = partition_values(*(int *) a);
+  long b_values = partition_values(*(int *) b);
+  return a_values < b_values ? 1 : (a_values > b_values ? -1 : 0);
+}
+
+int compare_tasks(const void *a, const void *b) {
+  long a_values = ((ReduceTask *) a)->num_values;
+  long b_values = ((ReduceTask *) b)->num_values;
+  return a_values < b_values ? 1 : (a_values > b_values ? -1 : 0);
+}
+
+void add_reduce_task(int partition_num, int first_key, int end_key, long num_values) {
+  if (num_reduce_tasks == reduce_tasks_capacity) {
+    reduce_tasks_capacity = reduce_tasks_capacity == 0 ? DEFAULT_DYN_ARR_CAPACITY : reduce_tasks_capacity * 2;
+    reduce_tasks = (ReduceTask *) realloc(reduce_tasks, reduce_tasks_capacity * sizeof(ReduceTask));
+    assert(reduce_tasks != NULL);
+  }
+  ReduceTask *task_p = &(reduce_tasks[num_reduce_tasks++]);
+  task_p->partition_num = partition_num;
+  task_p->first_key = first_key;
+  task_p->end_key = end_key;
+  task_p->num_values = num_values;
+}
+
+// cuts the sorted partitions into tasks, splitting any partition bigger than split_values
+// at key boundaries if splitting is enabled
+void build_reduce_tasks() {
+  long total_values = 0;
+  for (int i = 0; i < num_partitions; i++) {
+    total_values += stores[i].num_values;
+  }
+  long split_values = total_values / (num_pool_threads * TASKS_PER_THREAD);
+  if (split_values < MIN_TASK_VALUES) {
+    split_values = MIN_TASK_VALUES;
+  }
+  if (!split_partitions) {
+    split_values = LONG_MAX;
+  }
+
+  num_reduce_tasks = 0;
+  for (int i = 0; i < num_partitions; i++) {
+    KVStore *kvs_p = &(stores[i]);
+    if (kvs_p->num_runs > 0) {
+      add_reduce_task(i, 0, 0, partition_values(i));
+      continue; // its keys are counted as they come out of the merge
+    }
+    stats.unique_keys[i] = kvs_p->size;
+    int first_key = 0;
+    long num_values = 0;
+    for (int j = 0; j < kvs_p->size; j++) {
+      num_values += kvs_p->key_values_arr[j].size;
+      if (num_values >= split_values) {
+        add_reduce_task(i, first_key, j + 1, num_values);
+        first_key = j + 1;
+        num_values = 0;
+      }
+    }
+    if (first_key < kvs_p->size) {
+      add_reduce_task(i, first_key, kvs_p->size, num_values);
+    }
+  }
+  qsort(reduce_tasks, num_reduce_tasks, sizeof(ReduceTask), &compare_tasks);
+  next_reduce_task = 0;
+}
+
+void sort_partition(int partition_num) {
+  KVStore *kvs_p = &(stores[partition_num]);
+  if (kvs_p->num_runs > 0) {
+    // the partition went over its budget: it will be streamed back from disk instead
+    if (kvs_p->size > 0) {
+      spill_store(kvs_p);
+    }
+    return;
+  }
+  prepare_store(kvs_p);
+  multikey_qsort(kvs_p->key_values_arr, kvs_p->size, sizeof(KeyAndValues));
+}
+
+void run_reduce_task(ReduceTask *task_p) {
+  KVStore *kvs_p = &(stores[task_p->partition_num]);
+  if (kvs_p->num_runs > 0) {
+    merge_runs(kvs_p, task_p->partition_num, NULL);
+    return;
+  }
+  for (int i = task_p->first_key; i < task_p->end_key; i++) {
+    reduce_kav_p = &(kvs_p->key_values_arr[i]);
+    multikey_qsort(reduce_kav_p->values, reduce_kav_p->size, sizeof(char *));
+    global_reduce(reduce_kav_p->key, get_next, task_p->partition_num);
+  }
+  reduce_kav_p = NULL;
+}
+
+void *reduce_thread_func(void *unused) {
+  int i;
+  while ((i = __atomic_fetch_add(&next_sort, 1, __ATOMIC_RELAXED)) < num_partitions) {
+    sort_partition(sort_order[i]);
+  }
+
+  // one thread cuts up the work while the others wait for it
+  if (pthread_barrier_wait(&pool_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+    sort_end_time = now_seconds();
+    build_reduce_tasks();
+  }
+  pthread_barrier_wait(&pool_barrier);
+
+  while ((i = __atomic_fetch_add(&next_reduce_task, 1, __ATOMIC_RELAXED)) < num_reduce_tasks) {
+    run_reduce_task(&(reduce_tasks[i]));
   }
   return NULL;
 }
@@ -243,36 +1275,32 @@ void MR_Run(int argc, char *argv[],
   global_reduce = reduce;
   global_partition = partition;
   num_partitions = num_reducers;
+  num_map_threads = num_mappers;
+  free(stats.emits);
+  free(stats.unique_keys);
+  memset(&stats, 0, sizeof(stats));
+  stats.num_partitions = num_partitions;
+  stats.emits = (long *) calloc(num_partitions, sizeof(long));
+  stats.unique_keys = (long *) calloc(num_partitions, sizeof(long));
+  assert(stats.emits != NULL && stats.unique_keys != NULL);
+  held_bytes = 0;
+  lock_wait_nanos = 0;
   init_stores();
 
   // Create mapper threads
   if (is_verbose) {
     printf("Creating mapper threads\n");
   }
+  double phase_start = now_seconds();
   pthread_t *mappers = (pthread_t *) malloc(num_mappers * sizeof(pthread_t));
   assert(mappers != NULL);
   MapThreadArgs *map_thread_args_arr = (MapThreadArgs *) malloc(num_mappers * sizeof(MapThreadArgs));
-  // figure out how many elements of argv each thread mapper thread will handle
-  int total = 0;
-  int *num_args_arr = (int *) calloc(num_mappers, sizeof(int));
-  assert(num_args_arr != NULL);
-  while (total < argc - 1) {
-    num_args_arr[total % num_mappers]++;
-    total++;
-  }
-  // initialize thread args
+  assert(map_thread_args_arr != NULL);
+  init_map_files(argc, argv);
   for (int i = 0; i < num_mappers; i++) {
-    if (i == 0) {
-      map_thread_args_arr[i].start_index = 1;
-    } else {
-      map_thread_args_arr[i].start_index = map_thread_args_arr[i-1].end_index;
-    }
-    map_thread_args_arr[i].end_index = map_thread_args_arr[i].start_index + num_args_arr[i];
-    map_thread_args_arr[i].argv = argv;
-    
+    map_thread_args_arr[i].thread_index = i;
     assert(pthread_create(&(mappers[i]), NULL, map_thread_func, &(map_thread_args_arr[i])) == 0);
   }
-  free(num_args_arr);
 
   // Join mapper threads
   if (is_verbose) {
@@ -288,45 +1316,61 @@ void MR_Run(int argc, char *argv[],
   // Cleanup mappers
   free(mappers);
   free(map_thread_args_arr);
+  free(map_files);
 
-  // Sort kv_stores
-  if (is_verbose) {
-    printf("Sorting keys\n");
-  }
-  for (int i = 0; i < num_partitions; i++) {
-    KVStore *kvs_p = &(stores[i]);
-    qsort(kvs_p->key_values_arr, kvs_p->size, sizeof(KeyAndValues), &compare_by_key);
-    for (int i = 0; i < kvs_p->size; i++) {
-      KeyAndValues *kav_p = &(kvs_p->key_values_arr[i]);
-      qsort(kav_p->values, kav_p->size, sizeof(char *), qsort_strcmp);
-    }
-  }
+  stats.map_seconds = now_seconds() - phase_start;
   print_stores_state();
 
-  // Create reducer threads
+  // Create the reducer pool; it sorts the partitions, then reduces them
   if (is_verbose) {
     printf("Creating reducer threads\n");
   }
-  pthread_t *reducers = (pthread_t *) malloc(num_reducers * sizeof(pthread_t));
+  phase_start = now_seconds();
+  num_pool_threads = get_nprocs();
+  sort_order = (int *) malloc(num_partitions * sizeof(int));
+  assert(sort_order != NULL);
+  for (int i = 0; i < num_partitions; i++) {
+    sort_order[i] = i;
+  }
+  qsort(sort_order, num_partitions, sizeof(int), &compare_partitions);
+  next_sort = 0;
+  reduce_tasks = NULL;
+  reduce_tasks_capacity = 0;
+  pthread_barrier_init(&pool_barrier, NULL, num_pool_threads);
+  pthread_t *reducers = (pthread_t *) malloc(num_pool_threads * sizeof(pthread_t));
   assert(reducers != NULL);
-  int *reduce_thread_args_arr = (int *) malloc(num_reducers * sizeof(int));
-  for (int i = 0; i < num_reducers; i++) {
-    reduce_thread_args_arr[i] = i;
-    assert(pthread_create(&(reducers[i]), NULL, reduce_thread_func, &(reduce_thread_args_arr[i])) == 0);
+  for (int i = 0; i < num_pool_threads; i++) {
+    assert(pthread_create(&(reducers[i]), NULL, reduce_thread_func, NULL) == 0);
   }
 
   // Join reducer threads
   if (is_verbose) {
     printf("Joining reducer threads\n");
   }
-  for (int i = 0; i < num_reducers; i++) {
+  for (int i = 0; i < num_pool_threads; i++) {
     assert(pthread_join(reducers[i], NULL) == 0);
   }
-  free(reduce_thread_args_arr);
+  stats.sort_seconds = sort_end_time - phase_start;
+  stats.reduce_seconds = now_seconds() - sort_end_time;
+  stats.lock_wait_seconds = lock_wait_nanos / 1e9;
+  if (is_verbose) {
+    printf("Phase times: map %.3fs sort %.3fs reduce %.3fs\n",
+           stats.map_seconds, stats.sort_seconds, stats.reduce_seconds);
+    printf("Lock wait %.3fs, peak bytes %zu\n", stats.lock_wait_seconds, stats.peak_bytes);
+    for (int i = 0; i < num_partitions; i++) {
+      printf("Partition %i: %li emits, %li unique keys\n", i, stats.emits[i], stats.unique_keys[i]);
+    }
+  }
+  pthread_barrier_destroy(&pool_barrier);
+  free(sort_order);
+  free(reduce_tasks);
   free(reducers);
   free_stores();
 }
 
+// mr_bench.c and user programs provide their own main; build them with -DMR_NO_MAIN
+#ifndef MR_NO_MAIN
 int main(int argc, char **argv) {
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
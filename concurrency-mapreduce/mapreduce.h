@@ -1,17 +1,63 @@
 #ifndef __mapreduce_h__
 #define __mapreduce_h__
 
+#include <stddef.h>
+
 // Different function pointer types used by MR
 typedef char *(*Getter)(char *key, int partition_number);
 typedef void (*Mapper)(char *file_name);
+// Reduce is called once per unique key. The reducers run on a pool of one thread per core,
+// however many partitions there are, so different partitions are reduced concurrently.
+// By default all of a partition's keys are reduced by one thread, in sorted key order.
 typedef void (*Reducer)(char *key, Getter get_func, int partition_number);
 typedef unsigned long (*Partitioner)(char *key, int num_partitions);
 
+// Optional map-side combining: called once per key for the values a single mapper
+// thread emitted, after that thread runs out of files. get_func returns the values
+// until NULL; the combiner calls MR_Emit with whatever it wants the reducers to see.
+typedef char *(*CombineGetter)(char *key);
+typedef void (*Combiner)(char *key, CombineGetter get_func);
+
 // External functions: these are what you must define
 void MR_Emit(char *key, char *value);
 
 unsigned long MR_DefaultHashPartition(char *key, int num_partitions);
 
+// Call before MR_Run; pass NULL (the default) to disable combining.
+void MR_SetCombiner(Combiner combine);
+
+// Call before MR_Run; nonzero hands files to mappers largest-first instead of in argv order.
+void MR_SetLargestFirst(int enabled);
+
+// Call before MR_Run; nonzero lets a big partition be cut into key ranges that are reduced
+// by different threads at the same time. Each key still goes to a single reduce call, but the
+// keys of one partition are no longer reduced in order or by one thread, so any state the
+// reducer keeps per partition must be locked.
+void MR_SetSplitPartitions(int enabled);
+
+// Call before MR_Run; caps the intermediate key/value data held in memory at roughly
+// `bytes`, spilling sorted runs to temp files in $TMPDIR (or /tmp) beyond that. 0 (the
+// default) means no limit. With a budget, a value returned by get_next is only valid
+// until the next call to get_next.
+void MR_SetMemoryBudget(size_t bytes);
+
+// Counters from the last MR_Run, cheap enough that they are always collected.
+typedef struct MR_Stats {
+  double map_seconds; // wall time of each phase
+  double sort_seconds;
+  double reduce_seconds;
+  double lock_wait_seconds; // time threads spent blocked on partition locks, summed over threads
+  size_t peak_bytes; // most memory the intermediate key/value stores held at once
+  int num_partitions;
+  long *emits; // MR_Emit calls per partition, before any combining
+  long *unique_keys; // distinct keys per partition
+} MR_Stats;
+
+// Stats for the last MR_Run; the arrays stay valid until the next MR_Run.
+MR_Stats *MR_GetStats(void);
+
+// num_reducers is the number of partitions, not the number of reducer threads; see Reducer.
+
 void MR_Run(int argc, char *argv[], 
 	    Mapper map, int num_mappers, 
 	    Reducer reduce, int num_reducers, 
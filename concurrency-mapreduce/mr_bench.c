@@ -0,0 +1,376 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "mapreduce.h"
+
+/*
+
+  Micro-benchmarks for the MapReduce library.
+
+  Build with `make mr_bench`, or:
+    gcc -Wall -O2 -DMR_NO_MAIN -o mr_bench mr_bench.c mapreduce.c -pthread
+
+  Usage:
+    ./mr_bench emit [num_emits]
+      Emit throughput against the number of unique keys in the job.
+    ./mr_bench map [num_emits] [max_mappers]
+      Map phase throughput against num_mappers, with and without a combiner.
+    ./mr_bench reduce [values_per_key]
+      Reduce phase cost against the number of keys; time per value should stay flat.
+    ./mr_bench skew [max_mappers] [small_file_kb]
+      Word count over many small files plus one large file listed last, in argv order and
+      largest-first, against the ideal max(total / mappers, largest file).
+    ./mr_bench phases [num_emits] [max_reducers]
+      Map, sort and reduce phase times against num_reducers on a many-unique-keys job.
+    ./mr_bench unique [num_emits]
+      Emit throughput and peak RSS when every emit has a distinct key. Peak RSS is for the
+      whole process, so run this mode on its own.
+    ./mr_bench spill [num_emits] [budget_mb]
+      Time and peak RSS of a many-unique-keys job under a memory budget (0 for none).
+    ./mr_bench hot [num_emits] [num_reducers]
+      Sort and reduce times when nine keys in ten land in partition 0, against an even job,
+      with MR_SetSplitPartitions on so the pool can share out the hot partition.
+
+*/
+
+#define DEFAULT_NUM_EMITS (1000000)
+#define DEFAULT_MAX_MAPPERS (16)
+#define FILES_PER_MAPPER (4)
+#define MAP_BENCH_KEYS (1000)
+#define DEFAULT_VALUES_PER_KEY (10)
+#define MAX_REDUCE_BENCH_KEYS (1000000)
+#define DEFAULT_SMALL_FILE_KB (64)
+#define SKEW_SMALL_FILES (63)
+#define SKEW_LARGE_FILE_FACTOR (64) // the large file is this many small files
+#define WORD_VOCABULARY (1000)
+
+char **bench_keys;
+int bench_num_keys;
+int bench_num_emits;
+
+double bench_emit_seconds;
+double bench_reduce_seconds;
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void make_keys(int num_keys) {
+  bench_keys = (char **) malloc(num_keys * sizeof(char *));
+  assert(bench_keys != NULL);
+  for (int i = 0; i < num_keys; i++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key%08d", i);
+    bench_keys[i] = strdup(buf);
+    assert(bench_keys[i] != NULL);
+  }
+  bench_num_keys = num_keys;
+}
+
+void free_keys() {
+  for (int i = 0; i < bench_num_keys; i++) {
+    free(bench_keys[i]);
+  }
+  free(bench_keys);
+}
+
+// ignores the file name and emits bench_num_emits pairs cycling over bench_keys
+void EmitMap(char *file_name) {
+  double start = now_seconds();
+  for (int i = 0; i < bench_num_emits; i++) {
+    MR_Emit(bench_keys[i % bench_num_keys], "1");
+  }
+  bench_emit_seconds = now_seconds() - start;
+}
+
+void DrainReduce(char *key, Getter get_next, int partition_number) {
+  while (get_next(key, partition_number) != NULL)
+    ;
+}
+
+// emits every whitespace-separated word in the file with the value "1"
+void WordMap(char *file_name) {
+  FILE *fp = fopen(file_name, "r");
+  assert(fp != NULL);
+  char *line = NULL;
+  size_t size = 0;
+  while (getline(&line, &size, fp) != -1) {
+    char *token, *dummy = line;
+    while ((token = strsep(&dummy, " \t\n\r")) != NULL) {
+      if (*token != '\0') {
+        MR_Emit(token, "1");
+      }
+    }
+  }
+  free(line);
+  fclose(fp);
+}
+
+// writes roughly num_bytes of random words from a WORD_VOCABULARY-word vocabulary to a new
+// temp file and returns its name
+char *make_word_file(long num_bytes) {
+  char *file_name = strdup("/tmp/mr_bench_XXXXXX");
+  assert(file_name != NULL);
+  int fd = mkstemp(file_name);
+  assert(fd != -1);
+  FILE *fp = fdopen(fd, "w");
+  assert(fp != NULL);
+  long written = 0;
+  int words_on_line = 0;
+  while (written < num_bytes) {
+    written += fprintf(fp, "w%d", rand() % WORD_VOCABULARY);
+    if (++words_on_line == 12) {
+      written += fprintf(fp, "\n");
+      words_on_line = 0;
+    } else {
+      written += fprintf(fp, " ");
+    }
+  }
+  fclose(fp);
+  return file_name;
+}
+
+void TimedReduce(char *key, Getter get_next, int partition_number) {
+  double start = now_seconds();
+  while (get_next(key, partition_number) != NULL)
+    ;
+  bench_reduce_seconds += now_seconds() - start;
+}
+
+// sums the "1"s a mapper emitted for key into a single count
+void SumCombine(char *key, CombineGetter get_next) {
+  long count = 0;
+  char *value;
+  while ((value = get_next(key)) != NULL) {
+    count += atol(value);
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%ld", count);
+  MR_Emit(key, buf);
+}
+
+void bench_emit(int num_emits) {
+  char *fake_argv[] = {"mr_bench", "input"};
+  printf("%12s %12s %10s %12s\n", "unique_keys", "emits", "seconds", "Memits/s");
+  for (int num_keys = 10; num_keys <= num_emits / 10; num_keys *= 10) {
+    make_keys(num_keys);
+    bench_num_emits = num_emits;
+    MR_Run(2, fake_argv, EmitMap, 1, DrainReduce, 4, MR_DefaultHashPartition);
+    printf("%12d %12d %10.3f %12.2f\n", num_keys, num_emits, bench_emit_seconds,
+           num_emits / bench_emit_seconds / 1e6);
+    free_keys();
+  }
+}
+
+// each mapper handles FILES_PER_MAPPER fake files, splitting num_emits between all files
+void bench_map(int num_emits, int max_mappers) {
+  make_keys(MAP_BENCH_KEYS);
+  printf("%8s %10s %12s %10s %12s\n", "mappers", "combiner", "emits", "seconds", "Memits/s");
+  for (int use_combiner = 0; use_combiner <= 1; use_combiner++) {
+    MR_SetCombiner(use_combiner ? SumCombine : NULL);
+    for (int num_mappers = 1; num_mappers <= max_mappers; num_mappers *= 2) {
+      int num_files = num_mappers * FILES_PER_MAPPER;
+      char **fake_argv = (char **) malloc((num_files + 1) * sizeof(char *));
+      assert(fake_argv != NULL);
+      for (int i = 0; i <= num_files; i++) {
+        fake_argv[i] = "input";
+      }
+      bench_num_emits = num_emits / num_files;
+      double start = now_seconds();
+      MR_Run(num_files + 1, fake_argv, EmitMap, num_mappers, DrainReduce, 4, MR_DefaultHashPartition);
+      double seconds = now_seconds() - start;
+      long total = (long) bench_num_emits * num_files;
+      printf("%8d %10s %12ld %10.3f %12.2f\n", num_mappers, use_combiner ? "yes" : "no", total,
+             seconds, total / seconds / 1e6);
+      free(fake_argv);
+    }
+  }
+  MR_SetCombiner(NULL);
+  free_keys();
+}
+
+// one reducer pulls values_per_key values for each of num_keys keys
+void bench_reduce(int values_per_key) {
+  char *fake_argv[] = {"mr_bench", "input"};
+  printf("%12s %12s %10s %12s\n", "keys", "values", "seconds", "ns/value");
+  for (int num_keys = 1000; num_keys <= MAX_REDUCE_BENCH_KEYS; num_keys *= 10) {
+    make_keys(num_keys);
+    bench_num_emits = num_keys * values_per_key;
+    bench_reduce_seconds = 0;
+    MR_Run(2, fake_argv, EmitMap, 1, TimedReduce, 1, MR_DefaultHashPartition);
+    printf("%12d %12d %10.3f %12.1f\n", num_keys, bench_num_emits, bench_reduce_seconds,
+           bench_reduce_seconds / bench_num_emits * 1e9);
+    free_keys();
+  }
+}
+
+void bench_skew(int max_mappers, int small_file_kb) {
+  int num_files = SKEW_SMALL_FILES + 1;
+  long small_bytes = small_file_kb * 1024L;
+  long large_bytes = small_bytes * SKEW_LARGE_FILE_FACTOR;
+  long total_bytes = small_bytes * SKEW_SMALL_FILES + large_bytes;
+  char **fake_argv = (char **) malloc((num_files + 1) * sizeof(char *));
+  assert(fake_argv != NULL);
+  fake_argv[0] = "mr_bench";
+  for (int i = 1; i < num_files; i++) {
+    fake_argv[i] = make_word_file(small_bytes);
+  }
+  fake_argv[num_files] = make_word_file(large_bytes); // the large file goes last
+
+  // single mapper throughput, used to turn bytes into ideal times
+  double start = now_seconds();
+  MR_Run(num_files + 1, fake_argv, WordMap, 1, DrainReduce, 4, MR_DefaultHashPartition);
+  double bytes_per_second = total_bytes / (now_seconds() - start);
+
+  printf("%8s %14s %10s %10s\n", "mappers", "order", "seconds", "ideal");
+  for (int num_mappers = 1; num_mappers <= max_mappers; num_mappers *= 2) {
+    double ideal_bytes = (double) total_bytes / num_mappers;
+    if (ideal_bytes < large_bytes) {
+      ideal_bytes = large_bytes;
+    }
+    for (int largest_first = 0; largest_first <= 1; largest_first++) {
+      MR_SetLargestFirst(largest_first);
+      start = now_seconds();
+      MR_Run(num_files + 1, fake_argv, WordMap, num_mappers, DrainReduce, 4, MR_DefaultHashPartition);
+      printf("%8d %14s %10.3f %10.3f\n", num_mappers, largest_first ? "largest-first" : "argv",
+             now_seconds() - start, ideal_bytes / bytes_per_second);
+    }
+  }
+  MR_SetLargestFirst(0);
+
+  for (int i = 1; i <= num_files; i++) {
+    unlink(fake_argv[i]);
+    free(fake_argv[i]);
+  }
+  free(fake_argv);
+}
+
+// every emit has a random key out of num_emits / 4 and a random value
+void RandomMap(char *file_name) {
+  char value[16];
+  for (int i = 0; i < bench_num_emits; i++) {
+    snprintf(value, sizeof(value), "%d", rand() % 1000);
+    MR_Emit(bench_keys[rand() % bench_num_keys], value);
+  }
+}
+
+void bench_phases(int num_emits, int max_reducers) {
+  char *fake_argv[] = {"mr_bench", "input"};
+  make_keys(num_emits / 4);
+  bench_num_emits = num_emits;
+  printf("%9s %10s %10s %10s\n", "reducers", "map", "sort", "reduce");
+  for (int num_reducers = 1; num_reducers <= max_reducers; num_reducers *= 2) {
+    srand(1);
+    MR_Run(2, fake_argv, RandomMap, 1, DrainReduce, num_reducers, MR_DefaultHashPartition);
+    MR_Stats *stats = MR_GetStats();
+    printf("%9d %10.3f %10.3f %10.3f\n", num_reducers, stats->map_seconds, stats->sort_seconds,
+           stats->reduce_seconds);
+  }
+  free_keys();
+}
+
+void bench_unique(int num_emits) {
+  char *fake_argv[] = {"mr_bench", "input"};
+  make_keys(num_emits);
+  bench_num_emits = num_emits;
+  MR_Run(2, fake_argv, EmitMap, 1, DrainReduce, 4, MR_DefaultHashPartition);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%12s %10s %12s %14s\n", "emits", "seconds", "Memits/s", "peak_rss_mb");
+  printf("%12d %10.3f %12.2f %14.1f\n", num_emits, bench_emit_seconds,
+         num_emits / bench_emit_seconds / 1e6, usage.ru_maxrss / 1024.0);
+  free_keys();
+}
+
+void bench_spill(int num_emits, int budget_mb) {
+  char *fake_argv[] = {"mr_bench", "input"};
+  make_keys(num_emits / 4);
+  bench_num_emits = num_emits;
+  MR_SetMemoryBudget((size_t) budget_mb << 20);
+  srand(1);
+  double start = now_seconds();
+  MR_Run(2, fake_argv, RandomMap, 1, DrainReduce, 4, MR_DefaultHashPartition);
+  double seconds = now_seconds() - start;
+  MR_SetMemoryBudget(0);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%12s %10s %10s %14s\n", "emits", "budget_mb", "seconds", "peak_rss_mb");
+  printf("%12d %10d %10.3f %14.1f\n", num_emits, budget_mb, seconds, usage.ru_maxrss / 1024.0);
+  free_keys();
+}
+
+// sends nine keys in ten to partition 0 and spreads the rest over the others
+unsigned long HotPartition(char *key, int num_partitions) {
+  unsigned long hash = MR_DefaultHashPartition(key, 1 << 30);
+  if (num_partitions == 1 || hash % 10 != 0) {
+    return 0;
+  }
+  return 1 + hash % (num_partitions - 1);
+}
+
+void bench_hot(int num_emits, int num_reducers) {
+  char *fake_argv[] = {"mr_bench", "input"};
+  make_keys(num_emits / 4);
+  bench_num_emits = num_emits;
+  printf("%9s %10s %10s %10s %12s\n", "job", "map", "sort", "reduce", "p0_emits");
+  Partitioner partitioners[] = {MR_DefaultHashPartition, HotPartition};
+  char *names[] = {"even", "hot"};
+  // let the pool share partition 0 out between threads instead of one thread reducing it all
+  MR_SetSplitPartitions(1);
+  for (int i = 0; i < 2; i++) {
+    srand(1);
+    MR_Run(2, fake_argv, RandomMap, 1, DrainReduce, num_reducers, partitioners[i]);
+    MR_Stats *stats = MR_GetStats();
+    printf("%9s %10.3f %10.3f %10.3f %11.0f%%\n", names[i], stats->map_seconds,
+           stats->sort_seconds, stats->reduce_seconds, 100.0 * stats->emits[0] / num_emits);
+  }
+  MR_SetSplitPartitions(0);
+  free_keys();
+}
+
+void usage() {
+  fprintf(stderr, "usage: mr_bench emit [num_emits]\n");
+  fprintf(stderr, "       mr_bench map [num_emits] [max_mappers]\n");
+  fprintf(stderr, "       mr_bench reduce [values_per_key]\n");
+  fprintf(stderr, "       mr_bench skew [max_mappers] [small_file_kb]\n");
+  fprintf(stderr, "       mr_bench phases [num_emits] [max_reducers]\n");
+  fprintf(stderr, "       mr_bench unique [num_emits]\n");
+  fprintf(stderr, "       mr_bench spill [num_emits] [budget_mb]\n");
+  fprintf(stderr, "       mr_bench hot [num_emits] [num_reducers]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage();
+  }
+  if (strcmp(argv[1], "emit") == 0) {
+    bench_emit(argc > 2 ? atoi(argv[2]) : DEFAULT_NUM_EMITS);
+  } else if (strcmp(argv[1], "map") == 0) {
+    bench_map(argc > 2 ? atoi(argv[2]) : DEFAULT_NUM_EMITS,
+              argc > 3 ? atoi(argv[3]) : DEFAULT_MAX_MAPPERS);
+  } else if (strcmp(argv[1], "reduce") == 0) {
+    bench_reduce(argc > 2 ? atoi(argv[2]) : DEFAULT_VALUES_PER_KEY);
+  } else if (strcmp(argv[1], "skew") == 0) {
+    bench_skew(argc > 2 ? atoi(argv[2]) : DEFAULT_MAX_MAPPERS,
+               argc > 3 ? atoi(argv[3]) : DEFAULT_SMALL_FILE_KB);
+  } else if (strcmp(argv[1], "phases") == 0) {
+    bench_phases(argc > 2 ? atoi(argv[2]) : DEFAULT_NUM_EMITS,
+                 argc > 3 ? atoi(argv[3]) : DEFAULT_MAX_MAPPERS);
+  } else if (strcmp(argv[1], "unique") == 0) {
+    bench_unique(argc > 2 ? atoi(argv[2]) : DEFAULT_NUM_EMITS);
+  } else if (strcmp(argv[1], "spill") == 0) {
+    bench_spill(argc > 2 ? atoi(argv[2]) : DEFAULT_NUM_EMITS, argc > 3 ? atoi(argv[3]) : 0);
+  } else if (strcmp(argv[1], "hot") == 0) {
+    bench_hot(argc > 2 ? atoi(argv[2]) : DEFAULT_NUM_EMITS, argc > 3 ? atoi(argv[3]) : 8);
+  } else {
+    usage();
+  }
+  return 0;
+}
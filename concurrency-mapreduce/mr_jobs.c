@@ -0,0 +1,406 @@
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+#include <unistd.h>
+#include "mapreduce.h"
+
+/*
+
+  Benchmark driver for the MapReduce library: runs sample jobs over a synthetic corpus and
+  sweeps num_mappers and num_reducers, to catch performance regressions.
+
+  Build with `make mr_jobs` (or `make bench` to build and run it with the defaults).
+
+  Usage:
+    ./mr_jobs [-j job] [-k keys] [-s skew] [-b mb] [-f files] [-m max_mappers] [-r max_reducers]
+
+    -j  wordcount, index, sort or all (the default)
+    -k  key cardinality: number of distinct words in the corpus (default 100000)
+    -s  Zipf exponent of the word frequencies; 0 is uniform, 1 is roughly natural text
+        (default 1.0)
+    -b  corpus size in MB (default 64)
+    -f  number of corpus files (default 64)
+    -m  largest num_mappers in the sweep, doubling from 1 (default: cores * 2)
+    -r  largest num_reducers in the sweep, doubling from 1 (default: cores * 2)
+
+  Jobs:
+    wordcount  emits (word, "1") and sums the counts
+    index      emits (word, file name) and counts the distinct files per word
+    sort       reads "key payload" records and range-partitions them by key, so the
+               partitions come out in order as in a distributed sort
+
+  For each job the mappers are swept with num_reducers = cores, then the reducers with
+  num_mappers = cores. Throughput is corpus MB per second of MR_Run. Speedup is against the
+  first row of the sweep, and efficiency is speedup / min(threads, cores). Each job checks
+  its output against the corpus and prints "ok" or "WRONG".
+
+*/
+
+#define DEFAULT_NUM_KEYS (100000)
+#define DEFAULT_SKEW (1.0)
+#define DEFAULT_CORPUS_MB (64)
+#define DEFAULT_NUM_FILES (64)
+#define WORDS_PER_LINE (12)
+#define PAYLOAD_LEN (8)
+
+typedef struct Job {
+  char *name;
+  Mapper map;
+  Reducer reduce;
+  Partitioner partition;
+  bool uses_records; // reads the record corpus instead of the word corpus
+} Job;
+
+char **vocabulary;
+double *word_cdf; // cumulative Zipf probability of each word in the vocabulary
+int num_words;
+
+long corpus_words; // words in the word corpus, what wordcount should add up to
+long corpus_records; // records in the record corpus, what sort should output
+long total_count;
+long total_postings;
+long total_records;
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// distinct lowercase words of 3 to 10 letters: word i spells out a scrambled i in base 26
+void make_vocabulary(int num_keys, double skew) {
+  vocabulary = (char **) malloc(num_keys * sizeof(char *));
+  word_cdf = (double *) malloc(num_keys * sizeof(double));
+  assert(vocabulary != NULL && word_cdf != NULL);
+  double total = 0;
+  for (int i = 0; i < num_keys; i++) {
+    char buf[16];
+    unsigned long n = ((unsigned long) i * 2654435761UL) % 4294967291UL;
+    int len = 0;
+    do {
+      buf[len++] = 'a' + n % 26;
+      n /= 26;
+    } while (n > 0 && len < 7);
+    // the index itself as a suffix keeps the words distinct
+    snprintf(buf + len, sizeof(buf) - len, "%c%c%c", 'a' + i % 26, 'a' + i / 26 % 26,
+             'a' + i / 676 % 26);
+    vocabulary[i] = strdup(buf);
+    assert(vocabulary[i] != NULL);
+    total += 1.0 / pow(i + 1, skew);
+    word_cdf[i] = total;
+  }
+  for (int i = 0; i < num_keys; i++) {
+    word_cdf[i] /= total;
+  }
+  num_words = num_keys;
+}
+
+void free_vocabulary() {
+  for (int i = 0; i < num_words; i++) {
+    free(vocabulary[i]);
+  }
+  free(vocabulary);
+  free(word_cdf);
+}
+
+char *random_word() {
+  double r = (double) rand() / ((double) RAND_MAX + 1);
+  int lo = 0, hi = num_words - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (word_cdf[mid] < r) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return vocabulary[lo];
+}
+
+// writes num_files files of about file_bytes each into dir and returns their names. Word
+// files hold lines of WORDS_PER_LINE words; record files hold one "word payload" per line.
+char **make_corpus(char *dir, int num_files, long file_bytes, bool records) {
+  char **file_names = (char **) malloc(num_files * sizeof(char *));
+  assert(file_names != NULL);
+  for (int i = 0; i < num_files; i++) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s/%s%04d", dir, records ? "records" : "words", i);
+    file_names[i] = strdup(buf);
+    FILE *fp = fopen(file_names[i], "w");
+    assert(file_names[i] != NULL && fp != NULL);
+    long written = 0;
+    int words_on_line = 0;
+    while (written < file_bytes) {
+      if (records) {
+        char payload[PAYLOAD_LEN + 1];
+        for (int j = 0; j < PAYLOAD_LEN; j++) {
+          payload[j] = 'A' + rand() % 26;
+        }
+        payload[PAYLOAD_LEN] = '\0';
+        written += fprintf(fp, "%s %s\n", random_word(), payload);
+        corpus_records++;
+        continue;
+      }
+      written += fprintf(fp, "%s", random_word());
+      corpus_words++;
+      if (++words_on_line == WORDS_PER_LINE) {
+        written += fprintf(fp, "\n");
+        words_on_line = 0;
+      } else {
+        written += fprintf(fp, " ");
+      }
+    }
+    fclose(fp);
+  }
+  return file_names;
+}
+
+void free_corpus(char **file_names, int num_files) {
+  for (int i = 0; i < num_files; i++) {
+    unlink(file_names[i]);
+    free(file_names[i]);
+  }
+  free(file_names);
+}
+
+// calls emit on every whitespace-separated word in the file
+void for_each_word(char *file_name, void (*emit)(char *word, char *file_name)) {
+  FILE *fp = fopen(file_name, "r");
+  assert(fp != NULL);
+  char *line = NULL;
+  size_t size = 0;
+  while (getline(&line, &size, fp) != -1) {
+    char *token, *dummy = line;
+    while ((token = strsep(&dummy, " \t\n\r")) != NULL) {
+      if (*token != '\0') {
+        emit(token, file_name);
+      }
+    }
+  }
+  free(line);
+  fclose(fp);
+}
+
+void emit_one(char *word, char *file_name) {
+  MR_Emit(word, "1");
+}
+
+void WordCountMap(char *file_name) {
+  for_each_word(file_name, emit_one);
+}
+
+void WordCountReduce(char *key, Getter get_next, int partition_number) {
+  long count = 0;
+  char *value;
+  while ((value = get_next(key, partition_number)) != NULL) {
+    count += atol(value);
+  }
+  __atomic_fetch_add(&total_count, count, __ATOMIC_RELAXED);
+}
+
+void IndexMap(char *file_name) {
+  for_each_word(file_name, MR_Emit);
+}
+
+// the values come sorted, so each file's postings are next to each other
+void IndexReduce(char *key, Getter get_next, int partition_number) {
+  char last[256] = "";
+  long postings = 0;
+  char *value;
+  while ((value = get_next(key, partition_number)) != NULL) {
+    if (strcmp(value, last) != 0) {
+      postings++;
+      // a value is only valid until the next get_next with a memory budget, so copy it
+      snprintf(last, sizeof(last), "%s", value);
+    }
+  }
+  __atomic_fetch_add(&total_postings, postings, __ATOMIC_RELAXED);
+}
+
+void SortMap(char *file_name) {
+  FILE *fp = fopen(file_name, "r");
+  assert(fp != NULL);
+  char *line = NULL;
+  size_t size = 0;
+  while (getline(&line, &size, fp) != -1) {
+    char *payload = strchr(line, ' ');
+    assert(payload != NULL);
+    *payload++ = '\0';
+    payload[strcspn(payload, "\n")] = '\0';
+    MR_Emit(line, payload);
+  }
+  free(line);
+  fclose(fp);
+}
+
+void SortReduce(char *key, Getter get_next, int partition_number) {
+  long records = 0;
+  while (get_next(key, partition_number) != NULL) {
+    records++;
+  }
+  __atomic_fetch_add(&total_records, records, __ATOMIC_RELAXED);
+}
+
+// splits the key space by its first two letters, so partition i holds only keys smaller
+// than those of partition i + 1
+unsigned long letter_index(char c) {
+  return c >= 'a' && c <= 'z' ? c - 'a' : 0;
+}
+
+unsigned long RangePartition(char *key, int num_partitions) {
+  unsigned long prefix = letter_index(key[0]) * 26 + (key[0] != '\0' ? letter_index(key[1]) : 0);
+  return prefix * num_partitions / (26 * 26);
+}
+
+Job jobs[] = {
+  {"wordcount", WordCountMap, WordCountReduce, MR_DefaultHashPartition, false},
+  {"index", IndexMap, IndexReduce, MR_DefaultHashPartition, false},
+  {"sort", SortMap, SortReduce, RangePartition, true},
+};
+
+// runs the job once and returns the seconds MR_Run took
+double run_job(Job *job_p, char **file_names, int num_files, int num_mappers, int num_reducers) {
+  char **fake_argv = (char **) malloc((num_files + 1) * sizeof(char *));
+  assert(fake_argv != NULL);
+  fake_argv[0] = "mr_jobs";
+  memcpy(fake_argv + 1, file_names, num_files * sizeof(char *));
+  total_count = 0;
+  total_postings = 0;
+  total_records = 0;
+  double start = now_seconds();
+  MR_Run(num_files + 1, fake_argv, job_p->map, num_mappers, job_p->reduce, num_reducers,
+         job_p->partition);
+  double seconds = now_seconds() - start;
+  free(fake_argv);
+  return seconds;
+}
+
+// wordcount and sort have exact answers; the index can't have more postings than
+// (word, file) pairs, and it has at least one per distinct word
+bool job_output_ok(Job *job_p, int num_files) {
+  if (job_p->map == WordCountMap) {
+    return total_count == corpus_words;
+  } else if (job_p->map == SortMap) {
+    return total_records == corpus_records;
+  }
+  return total_postings > 0 && total_postings <= (long) num_words * num_files;
+}
+
+void print_row(Job *job_p, char *sweep, int num_mappers, int num_reducers, double seconds,
+               double base_seconds, int threads, double corpus_mb, bool ok) {
+  int cores = get_nprocs();
+  double speedup = base_seconds / seconds;
+  MR_Stats *stats = MR_GetStats();
+  printf("%-10s %-8s %7d %8d %8.3f %8.1f %8.2f %6.0f%% %8.3f %8.1f %6s\n", job_p->name, sweep,
+         num_mappers, num_reducers, seconds, corpus_mb / seconds, speedup,
+         100.0 * speedup / (threads < cores ? threads : cores), stats->lock_wait_seconds,
+         stats->peak_bytes / 1048576.0, ok ? "ok" : "WRONG");
+}
+
+void sweep_job(Job *job_p, char **file_names, int num_files, double corpus_mb,
+               int max_mappers, int max_reducers) {
+  int cores = get_nprocs();
+  double base_seconds = 0;
+  for (int num_mappers = 1; num_mappers <= max_mappers; num_mappers *= 2) {
+    double seconds = run_job(job_p, file_names, num_files, num_mappers, cores);
+    if (num_mappers == 1) {
+      base_seconds = seconds;
+    }
+    print_row(job_p, "mappers", num_mappers, cores, seconds, base_seconds, num_mappers,
+              corpus_mb, job_output_ok(job_p, num_files));
+  }
+  for (int num_reducers = 1; num_reducers <= max_reducers; num_reducers *= 2) {
+    double seconds = run_job(job_p, file_names, num_files, cores, num_reducers);
+    if (num_reducers == 1) {
+      base_seconds = seconds;
+    }
+    print_row(job_p, "reducers", cores, num_reducers, seconds, base_seconds, num_reducers,
+              corpus_mb, job_output_ok(job_p, num_files));
+  }
+}
+
+void usage() {
+  fprintf(stderr, "usage: mr_jobs [-j wordcount|index|sort|all] [-k keys] [-s skew] [-b mb]\n");
+  fprintf(stderr, "               [-f files] [-m max_mappers] [-r max_reducers]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  char *job_name = "all";
+  int num_keys = DEFAULT_NUM_KEYS;
+  double skew = DEFAULT_SKEW;
+  int corpus_mb = DEFAULT_CORPUS_MB;
+  int num_files = DEFAULT_NUM_FILES;
+  int max_mappers = get_nprocs() * 2;
+  int max_reducers = get_nprocs() * 2;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:k:s:b:f:m:r:")) != -1) {
+    switch (opt) {
+      case 'j': job_name = optarg; break;
+      case 'k': num_keys = atoi(optarg); break;
+      case 's': skew = atof(optarg); break;
+      case 'b': corpus_mb = atoi(optarg); break;
+      case 'f': num_files = atoi(optarg); break;
+      case 'm': max_mappers = atoi(optarg); break;
+      case 'r': max_reducers = atoi(optarg); break;
+      default: usage();
+    }
+  }
+  if (num_keys < 1 || skew < 0 || corpus_mb < 1 || num_files < 1 || max_mappers < 1
+      || max_reducers < 1) {
+    usage();
+  }
+  int num_jobs = sizeof(jobs) / sizeof(jobs[0]);
+  bool found = strcmp(job_name, "all") == 0;
+  for (int i = 0; i < num_jobs; i++) {
+    found = found || strcmp(job_name, jobs[i].name) == 0;
+  }
+  if (!found) {
+    usage();
+  }
+
+  char *tmp_dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+  char dir[256];
+  snprintf(dir, sizeof(dir), "%s/mr_jobs_XXXXXX", tmp_dir);
+  if (mkdtemp(dir) == NULL) {
+    fprintf(stderr, "mr_jobs: cannot create %s: %s\n", dir, strerror(errno));
+    exit(1);
+  }
+  srand(1);
+  make_vocabulary(num_keys, skew);
+  long file_bytes = (long) corpus_mb * 1048576 / num_files;
+  char **word_files = NULL;
+  char **record_files = NULL;
+
+  printf("%d cores, %d keys, skew %.2f, %d MB in %d files\n", get_nprocs(), num_keys, skew,
+         corpus_mb, num_files);
+  printf("%-10s %-8s %7s %8s %8s %8s %8s %7s %8s %8s %6s\n", "job", "sweep", "mappers",
+         "reducers", "seconds", "MB/s", "speedup", "eff", "lock_s", "peak_mb", "check");
+  for (int i = 0; i < num_jobs; i++) {
+    if (strcmp(job_name, "all") != 0 && strcmp(job_name, jobs[i].name) != 0) {
+      continue;
+    }
+    char ***files_p = jobs[i].uses_records ? &record_files : &word_files;
+    if (*files_p == NULL) {
+      *files_p = make_corpus(dir, num_files, file_bytes, jobs[i].uses_records);
+    }
+    sweep_job(&(jobs[i]), *files_p, num_files, corpus_mb, max_mappers, max_reducers);
+  }
+
+  if (word_files != NULL) {
+    free_corpus(word_files, num_files);
+  }
+  if (record_files != NULL) {
+    free_corpus(record_files, num_files);
+  }
+  rmdir(dir);
+  free_vocabulary();
+  return 0;
+}
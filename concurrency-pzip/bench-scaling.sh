@@ -0,0 +1,73 @@
+#! /bin/bash
+
+# Scaling report for pzip: MB/s and speedup over one worker for each worker count, with the
+# threads pinned to CPUs (-a), unpinned, and in NUMA mode (-n), at a few queue depths, and
+# each mode's speed against the pinned run with the same queue depth and workers.
+# usage: ./bench-scaling.sh [size_mb] [csv] (default 256 MB, scaling.csv)
+
+if ! [[ -x pzip ]]; then
+    echo "pzip executable does not exist"
+    exit 1
+fi
+
+size_mb=${1:-256}
+csv=${2:-scaling.csv}
+cpus=$(nproc)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# log-like lines, so the consumers have work to do for every byte
+yes "2024-01-01 00:00:00 INFO      request served ........................ 200" \
+    | head -c $((size_mb * 1048576)) > "$dir/input"
+
+workers=""
+for ((t = 1; t < cpus; t *= 2)); do
+    workers="$workers $t"
+done
+workers="$workers $cpus"
+
+# one run, best of three; prints milliseconds
+run() {
+    local best=0
+    for i in 1 2 3; do
+        local start=$(date +%s%N)
+        ./pzip "$@" "$dir/input" > "$dir/output"
+        local ms=$((($(date +%s%N) - start) / 1000000))
+        if ((best == 0 || ms < best)); then
+            best=$ms
+        fi
+    done
+    echo $((best > 0 ? best : 1))
+}
+
+nodes=$(ls -d /sys/devices/system/node/node* 2>/dev/null | wc -l)
+echo "$cpus CPUs on $nodes NUMA node(s)"
+
+declare -A pinned_ms
+echo "mode,queue,workers,ms,mb_per_s,speedup,vs_pinned" > "$csv"
+printf "%-9s %6s %8s %8s %8s %8s %10s\n" mode queue workers ms MB/s speedup vs_pinned
+for mode in pinned unpinned numa; do
+    case $mode in
+        unpinned) flags="" ;;
+        pinned) flags="-a 0-$((cpus - 1))" ;;
+        numa) flags="-n" ;;
+    esac
+    for queue in 16 64 256; do
+        base=0
+        for t in $workers; do
+            ms=$(run $flags -q $queue -t $t)
+            if ((base == 0)); then
+                base=$ms
+            fi
+            mbs=$((size_mb * 1000 / ms))
+            speedup=$(awk "BEGIN { printf \"%.2f\", $base / $ms }")
+            if [[ $mode == pinned ]]; then
+                pinned_ms[$queue,$t]=$ms
+            fi
+            vs_pinned=$(awk "BEGIN { printf \"%.2f\", ${pinned_ms[$queue,$t]} / $ms }")
+            printf "%-9s %6d %8d %8d %8d %8s %10s\n" $mode $queue $t $ms $mbs $speedup $vs_pinned
+            echo "$mode,$queue,$t,$ms,$mbs,$speedup,$vs_pinned" >> "$csv"
+        done
+    done
+done
+echo "results written to $csv"
@@ -0,0 +1,41 @@
+#! /bin/bash
+
+# Times pzip on many small files against one big file holding the same bytes, and checks
+# that both give the same output.
+# usage: ./bench-small-files.sh [num_files] [file_bytes] (default 20000 files of 4096 bytes)
+
+if ! [[ -x pzip ]]; then
+    echo "pzip executable does not exist"
+    exit 1
+fi
+
+num_files=${1:-20000}
+file_bytes=${2:-4096}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# log-like lines with runs of a few to a few dozen bytes, then the same bytes split into
+# small files, so the per-file cost shows instead of the cost of writing the output
+yes "2024-01-01 00:00:00 INFO      request served ........................ 200" \
+    | head -c $((num_files * file_bytes)) > "$dir/big"
+mkdir "$dir/small"
+(cd "$dir/small" && split -a 6 -b "$file_bytes" ../big f)
+
+run() {
+    local name=$1
+    shift
+    local start=$(date +%s%N)
+    ./pzip "$@" > "$dir/$name.z"
+    local end=$(date +%s%N)
+    local ms=$(((end - start) / 1000000))
+    printf "%-8s %8d %12d %10d %10d\n" "$name" "$#" $((num_files * file_bytes)) "$ms" \
+        $((num_files * file_bytes * 1000 / (ms > 0 ? ms : 1) / 1048576))
+}
+
+printf "%-8s %8s %12s %10s %10s\n" input files bytes ms MB/s
+run big "$dir/big"
+run small "$dir"/small/f*
+if ! cmp -s "$dir/big.z" "$dir/small.z"; then
+    echo "outputs differ"
+    exit 1
+fi
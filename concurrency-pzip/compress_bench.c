@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+
+  Throughput benchmark for the compressors and decompressors: wzip, pzip, wunzip, punzip.
+
+  Build with `make compress_bench` (or `make bench` to build everything and run it).
+
+  Usage:
+    ./compress_bench [-o csv] [-s sizes_mb] [-t threads] [-d dir]
+
+    -o  file the results are written to as CSV (default compress_bench.csv)
+    -s  comma separated corpus sizes in MB (default 16,64)
+    -t  comma separated thread counts for pzip and punzip (default 1, 2, 4, ... up to the
+        CPUs this process may run on)
+    -d  directory for the corpora and outputs (default a fresh directory under /tmp)
+
+  Corpora, with run lengths from all long to all short:
+    all-same  one byte repeated
+    log       log lines padded with runs of spaces and dots
+    text      English-like words and spaces, mostly runs of one or two
+    random    uniformly random bytes
+
+  pzip-f and punzip-f are pzip and punzip on the framed format (pzip -f). Every tool runs on
+  every corpus and size; the parallel ones run once per thread count, on that many CPUs (at
+  most all of them) and with PZIP_THREADS set to it, and wzip and wunzip on one. The tools
+  are found at WZIP, WUNZIP, PZIP and PUNZIP in the environment, or in their default build
+  locations, and a tool that isn't there is skipped. Each row gives MB/s of uncompressed
+  data, the compression ratio (compressed / uncompressed bytes), the tool's peak RSS, and
+  for the decompressors whether the output matched the corpus.
+
+*/
+
+#define DEFAULT_SIZES "16,64"
+#define DEFAULT_CSV "compress_bench.csv"
+#define MAX_LIST 32
+
+struct Tool
+{
+  char *name;
+  char *env; // environment variable that overrides the path
+  char *path;
+  char *option; // passed before the input file, or NULL
+  char *compressor; // for a decompressor, the tool whose output it reads
+  int parallel;
+};
+
+struct Tool tools[] = {
+  {"wzip", "WZIP", "../initial-utilities/wzip/wzip", NULL, NULL, 0},
+  {"pzip", "PZIP", "./pzip", NULL, NULL, 1},
+  {"pzip-f", "PZIP", "./pzip", "-f", NULL, 1},
+  {"wunzip", "WUNZIP", "../initial-utilities/wunzip/wunzip", NULL, "wzip", 0},
+  {"punzip", "PUNZIP", "./punzip", NULL, "pzip", 1},
+  {"punzip-f", "PUNZIP", "./punzip", NULL, "pzip-f", 1},
+};
+int numTools = sizeof(tools) / sizeof(tools[0]);
+
+char *corpora[] = {"all-same", "log", "text", "random"};
+int numCorpora = sizeof(corpora) / sizeof(corpora[0]);
+
+uint64_t rngState = 88172645463325252ULL;
+
+// xorshift64, so the corpora are the same on every run and machine
+uint64_t nextRandom()
+{
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 7;
+  rngState ^= rngState << 17;
+  return rngState;
+}
+
+double nowSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// appends word to buf at *i, stopping at size
+void put(char *buf, size_t size, size_t *i, const char *word)
+{
+  for (int j = 0; word[j] != '\0' && *i < size; j++)
+  {
+    buf[(*i)++] = word[j];
+  }
+}
+
+void fillCorpus(char *buf, size_t size, int corpus)
+{
+  static char *words[] = {"the", "of", "and", "to", "in", "a", "is", "that", "for", "it",
+                          "file", "thread", "compress", "parallel", "letter", "all", "will"};
+  static char *levels[] = {"INFO     ", "DEBUG    ", "WARN     ", "ERROR    "};
+  int numWords = sizeof(words) / sizeof(words[0]);
+  size_t i = 0;
+  if (corpus == 0)
+  {
+    memset(buf, 'a', size);
+    return;
+  }
+  while (i < size)
+  {
+    if (corpus == 1)
+    {
+      char line[128];
+      uint64_t r = nextRandom();
+      snprintf(line, sizeof(line), "2024-01-01 00:%02d:%02d %s request served %.*s %d\n",
+               (int)(r % 60), (int)(r / 60 % 60), levels[r / 3600 % 4], (int)(8 + r / 16384 % 24),
+               "................................", 200 + (int)(r / 1024 % 4) * 100);
+      put(buf, size, &i, line);
+    }
+    else if (corpus == 2)
+    {
+      uint64_t r = nextRandom();
+      put(buf, size, &i, words[r % numWords]);
+      put(buf, size, &i, r / 256 % 12 == 0 ? "\n" : " ");
+    }
+    else
+    {
+      uint64_t r = nextRandom();
+      for (int j = 0; j < 8 && i < size; j++)
+      {
+        buf[i++] = r >> (8 * j);
+      }
+    }
+  }
+}
+
+void writeFile(char *name, char *buf, size_t size)
+{
+  FILE *f = fopen(name, "wb");
+  if (f == NULL || fwrite(buf, 1, size, f) != size)
+  {
+    printf("compress_bench: cannot write %s\n", name);
+    exit(1);
+  }
+  fclose(f);
+}
+
+off_t fileSize(char *name)
+{
+  struct stat st;
+  return stat(name, &st) == 0 ? st.st_size : -1;
+}
+
+// 1 if the two files hold the same bytes
+int sameFiles(char *a, char *b)
+{
+  FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+  int same = fa != NULL && fb != NULL;
+  char bufA[1 << 16], bufB[1 << 16];
+  while (same)
+  {
+    size_t na = fread(bufA, 1, sizeof(bufA), fa);
+    size_t nb = fread(bufB, 1, sizeof(bufB), fb);
+    same = na == nb && memcmp(bufA, bufB, na) == 0;
+    if (na == 0)
+    {
+      break;
+    }
+  }
+  if (fa != NULL)
+  {
+    fclose(fa);
+  }
+  if (fb != NULL)
+  {
+    fclose(fb);
+  }
+  return same;
+}
+
+// runs the tool on input with stdout going to output, on the first numCpus CPUs in cpus;
+// returns the seconds it took and its peak RSS in KB, or -1 seconds if it failed
+double runTool(struct Tool *tool, char *input, char *output, cpu_set_t *cpus, int numCpus, long *peakKb)
+{
+  double start = nowSeconds();
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    cpu_set_t use;
+    CPU_ZERO(&use);
+    for (int cpu = 0, taken = 0; cpu < CPU_SETSIZE && taken < numCpus; cpu++)
+    {
+      if (CPU_ISSET(cpu, cpus))
+      {
+        CPU_SET(cpu, &use);
+        taken++;
+      }
+    }
+    sched_setaffinity(0, sizeof(use), &use);
+    char workers[16];
+    snprintf(workers, sizeof(workers), "%d", numCpus);
+    setenv("PZIP_THREADS", workers, 1);
+    int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1 || dup2(out, STDOUT_FILENO) == -1)
+    {
+      _exit(127);
+    }
+    if (tool->option != NULL)
+    {
+      execl(tool->path, tool->path, tool->option, input, (char *)NULL);
+    }
+    execl(tool->path, tool->path, input, (char *)NULL);
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (pid == -1 || wait4(pid, &status, 0, &usage) == -1)
+  {
+    return -1;
+  }
+  double seconds = nowSeconds() - start;
+  *peakKb = usage.ru_maxrss;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? seconds : -1;
+}
+
+// parses a comma separated list of positive numbers into list; returns how many there were
+int parseList(char *arg, long *list)
+{
+  int n = 0;
+  char *end = arg;
+  while (*end != '\0' && n < MAX_LIST)
+  {
+    list[n] = strtol(end, &end, 10);
+    if (list[n++] <= 0 || (*end != ',' && *end != '\0'))
+    {
+      return 0;
+    }
+    end += *end == ',';
+  }
+  return n;
+}
+
+void usage()
+{
+  printf("compress_bench: [-o csv] [-s sizes_mb] [-t threads] [-d dir]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *csvName = DEFAULT_CSV;
+  char *dir = NULL;
+  long sizes[MAX_LIST], threads[MAX_LIST];
+  int numSizes = parseList(DEFAULT_SIZES, sizes);
+  int numThreads = 0;
+
+  cpu_set_t cpus;
+  sched_getaffinity(0, sizeof(cpus), &cpus);
+  int numCpus = CPU_COUNT(&cpus);
+  for (long t = 1; t < numCpus && numThreads < MAX_LIST - 1; t *= 2)
+  {
+    threads[numThreads++] = t;
+  }
+  threads[numThreads++] = numCpus;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:s:t:d:")) != -1)
+  {
+    if (opt == 'o')
+    {
+      csvName = optarg;
+    }
+    else if (opt == 's')
+    {
+      numSizes = parseList(optarg, sizes);
+    }
+    else if (opt == 't')
+    {
+      numThreads = parseList(optarg, threads);
+    }
+    else if (opt == 'd')
+    {
+      dir = optarg;
+    }
+    else
+    {
+      usage();
+    }
+  }
+  if (optind != argc || numSizes == 0 || numThreads == 0)
+  {
+    usage();
+  }
+
+  char tmpDir[] = "/tmp/compress_bench.XXXXXX";
+  if (dir == NULL && (dir = mkdtemp(tmpDir)) == NULL)
+  {
+    printf("compress_bench: cannot create a directory\n");
+    exit(1);
+  }
+  for (int t = 0; t < numTools; t++)
+  {
+    char *path = getenv(tools[t].env);
+    if (path != NULL)
+    {
+      tools[t].path = path;
+    }
+    if (access(tools[t].path, X_OK) != 0)
+    {
+      printf("%s not found at %s, skipping it\n", tools[t].name, tools[t].path);
+      tools[t].path = NULL;
+    }
+  }
+
+  FILE *csv = fopen(csvName, "w");
+  if (csv == NULL)
+  {
+    printf("compress_bench: cannot open %s\n", csvName);
+    exit(1);
+  }
+  fprintf(csv, "tool,corpus,size_bytes,threads,seconds,mb_per_s,ratio,peak_rss_kb,check\n");
+  printf("%-9s %-9s %8s %7s %8s %8s %7s %10s %6s\n", "tool", "corpus", "MB", "threads",
+         "seconds", "MB/s", "ratio", "peak KB", "check");
+
+  for (int s = 0; s < numSizes; s++)
+  {
+    size_t size = (size_t)sizes[s] << 20;
+    for (int c = 0; c < numCorpora; c++)
+    {
+      // the buffer is unmapped before the tools run: a forked child's peak RSS starts out at
+      // its parent's, and exec doesn't reset it. It's mmapped, not malloced, so that free
+      // can't keep it around in the heap
+      char corpusName[1024];
+      char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      snprintf(corpusName, sizeof(corpusName), "%s/%s-%ld", dir, corpora[c], sizes[s]);
+      fillCorpus(buf, size, c);
+      writeFile(corpusName, buf, size);
+      munmap(buf, size);
+
+      for (int t = 0; t < numTools; t++)
+      {
+        struct Tool *tool = &tools[t];
+        for (int n = 0; n < (tool->parallel ? numThreads : 1) && tool->path != NULL; n++)
+        {
+          // a decompressor reads its compressor's output at the same thread count
+          char input[1200], output[1200];
+          int runThreads = tool->parallel ? threads[n] : 1;
+          if (tool->compressor != NULL)
+          {
+            snprintf(input, sizeof(input), "%s.%s-%d", corpusName, tool->compressor, runThreads);
+          }
+          else
+          {
+            snprintf(input, sizeof(input), "%s", corpusName);
+          }
+          snprintf(output, sizeof(output), "%s.%s-%d", corpusName, tool->name, runThreads);
+          if (fileSize(input) < 0)
+          {
+            continue;
+          }
+
+          long peakKb = 0;
+          double seconds = runTool(tool, input, output, &cpus, runThreads, &peakKb);
+          double ratio = (double)fileSize(tool->compressor != NULL ? input : output) / size;
+          char *check = tool->compressor == NULL ? "-" : sameFiles(output, corpusName) ? "ok" : "WRONG";
+          if (seconds < 0)
+          {
+            check = "failed";
+          }
+          double mbPerSecond = seconds > 0 ? sizes[s] / seconds : 0;
+          printf("%-9s %-9s %8ld %7d %8.3f %8.1f %7.4f %10ld %6s\n", tool->name, corpora[c],
+                 sizes[s], runThreads, seconds, mbPerSecond, ratio, peakKb, check);
+          fprintf(csv, "%s,%s,%zu,%d,%.6f,%.3f,%.6f,%ld,%s\n", tool->name, corpora[c], size,
+                  runThreads, seconds, mbPerSecond, ratio, peakKb, check);
+          fflush(stdout);
+        }
+      }
+
+      // drop this corpus and its outputs before making the next one
+      for (int t = 0; t < numTools; t++)
+      {
+        for (int n = 0; n < numThreads; n++)
+        {
+          char output[1200];
+          snprintf(output, sizeof(output), "%s.%s-%ld", corpusName, tools[t].name, threads[n]);
+          unlink(output);
+        }
+        char output[1200];
+        snprintf(output, sizeof(output), "%s.%s-1", corpusName, tools[t].name);
+        unlink(output);
+      }
+      unlink(corpusName);
+    }
+  }
+
+  fclose(csv);
+  if (dir == tmpDir)
+  {
+    rmdir(dir);
+  }
+  printf("results written to %s\n", csvName);
+  return 0;
+}
@@ -0,0 +1,509 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+
+  punzip: parallel decompressor for the wzip/pzip formats: [int count][char] records, or the
+  framed format written by wzip -f and pzip -f, which is detected by its header.
+
+  Build with:
+    gcc -Wall -Werror -pthread -O -o punzip punzip.c
+
+  Usage:
+    punzip file1 [file2 ...]
+      Decompress every file to stdout, like wunzip.
+    punzip -w index file
+      Also write a sidecar index for file.
+    punzip [-i index] -r offset,length file
+      Write only bytes [offset, offset + length) of the decompressed file. With an index the
+      run lengths aren't summed again, so only the records around the range are read.
+
+  The input is mmapped and cut into chunks of RECORDS_PER_CHUNK records. First every thread
+  sums the run lengths of its share of the chunks, and a scan over those sums gives the output
+  offset of each chunk. Then the output is cut into SLAB_SIZE slabs: each thread finds where
+  its slab starts with a binary search over the chunk offsets and fills it with memset, while
+  the main thread writes the previous round of slabs out.
+
+  The sidecar index is those chunk offsets:
+    "WZIX" [uint32 records per chunk] [uint64 number of records]
+    then number of chunks + 1 [uint64 output offset]s, the last one being the output size
+
+  A framed file carries its own index: each frame header gives the frame's compressed and
+  decompressed size, so one walk over the headers gives every frame's output offset, and
+  the frames then play the part of the chunks. A slab starting inside a frame decodes the
+  frame's tokens from its start, copying out only the part inside the slab. -w and -i
+  don't apply to framed files.
+
+*/
+
+#define RECORD_SIZE (sizeof(int) + sizeof(char))
+#define RECORDS_PER_CHUNK (1 << 16)
+#define SLAB_SIZE (4 << 20)
+#define INDEX_MAGIC "WZIX"
+#define FRAMED_MAGIC "\0\0\0\0WZV1"
+#define FRAMED_MAGIC_SIZE 8
+
+int totalTh;
+
+// the file being decompressed
+char *records;
+long numRecords;
+long recordsPerChunk;
+long numChunks;
+uint64_t *chunkOffset; // output offset of each chunk, numChunks + 1 of them
+
+// for a framed file, where each frame's tokens start and end in it; the frames are the chunks
+int framedInput;
+uint64_t *frameStart;
+uint64_t *frameEnd;
+size_t inputSize;
+
+// the output range being written, and the double-buffered slabs it is expanded into
+uint64_t outStart;
+uint64_t outEnd;
+long numRounds;
+char *slabs[2];
+pthread_barrier_t roundDone;
+
+static inline uint64_t runLength(long rec)
+{
+  int count;
+  memcpy(&count, records + rec * RECORD_SIZE, sizeof(int));
+  return count > 0 ? count : 0;
+}
+
+static inline char runChar(long rec)
+{
+  return records[rec * RECORD_SIZE + sizeof(int)];
+}
+
+// sums the run lengths of this thread's share of the chunks into chunkOffset[c + 1]
+void *sumWorker(void *arg)
+{
+  long t = (long)arg;
+  long firstChunk = numChunks * t / totalTh;
+  long endChunk = numChunks * (t + 1) / totalTh;
+  for (long c = firstChunk; c < endChunk; c++)
+  {
+    long endRecord = (c + 1) * recordsPerChunk < numRecords ? (c + 1) * recordsPerChunk : numRecords;
+    uint64_t sum = 0;
+    for (long rec = c * recordsPerChunk; rec < endRecord; rec++)
+    {
+      sum += runLength(rec);
+    }
+    chunkOffset[c + 1] = sum;
+  }
+  return NULL;
+}
+
+// parallel prefix sum: each thread sums its chunks, then one scan over the chunk sums
+void computeChunkOffsets()
+{
+  pthread_t tid[totalTh];
+  for (long t = 0; t < totalTh; t++)
+  {
+    pthread_create(&tid[t], NULL, sumWorker, (void *)t);
+  }
+  for (int t = 0; t < totalTh; t++)
+  {
+    pthread_join(tid[t], NULL);
+  }
+  chunkOffset[0] = 0;
+  for (long c = 0; c < numChunks; c++)
+  {
+    chunkOffset[c + 1] += chunkOffset[c];
+  }
+}
+
+void corruptInput()
+{
+  printf("punzip: corrupt input\n");
+  exit(1);
+}
+
+// reads a little-endian base 128 varint from records[*at], stopping at limit
+uint64_t readVarint(uint64_t *at, uint64_t limit)
+{
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64 && *at < limit; shift += 7)
+  {
+    unsigned char c = records[(*at)++];
+    value |= (uint64_t)(c & 0x7f) << shift;
+    if ((c & 0x80) == 0)
+    {
+      return value;
+    }
+  }
+  corruptInput();
+  return 0;
+}
+
+// walks the frame headers of a framed file, recording where each frame's tokens are and,
+// in chunkOffset, where its output goes
+void scanFrames()
+{
+  long capacity = 1024;
+  frameStart = realloc(frameStart, sizeof(uint64_t) * capacity);
+  frameEnd = realloc(frameEnd, sizeof(uint64_t) * capacity);
+  chunkOffset = realloc(chunkOffset, sizeof(uint64_t) * (capacity + 1));
+  chunkOffset[0] = 0;
+  numChunks = 0;
+  uint64_t at = FRAMED_MAGIC_SIZE;
+  while (at < inputSize)
+  {
+    uint64_t payloadBytes = readVarint(&at, inputSize);
+    uint64_t decodedBytes = readVarint(&at, inputSize);
+    if (payloadBytes > inputSize - at || decodedBytes > UINT64_MAX - chunkOffset[numChunks])
+    {
+      corruptInput();
+    }
+    if (numChunks == capacity)
+    {
+      capacity *= 2;
+      frameStart = realloc(frameStart, sizeof(uint64_t) * capacity);
+      frameEnd = realloc(frameEnd, sizeof(uint64_t) * capacity);
+      chunkOffset = realloc(chunkOffset, sizeof(uint64_t) * (capacity + 1));
+    }
+    frameStart[numChunks] = at;
+    frameEnd[numChunks] = at + payloadBytes;
+    chunkOffset[numChunks + 1] = chunkOffset[numChunks] + decodedBytes;
+    numChunks++;
+    at += payloadBytes;
+  }
+}
+
+// the last chunk starting at or before start
+long findChunk(uint64_t start)
+{
+  long lo = 0, hi = numChunks - 1;
+  while (lo < hi)
+  {
+    long mid = lo + (hi - lo + 1) / 2;
+    if (chunkOffset[mid] <= start)
+    {
+      lo = mid;
+    }
+    else
+    {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+// fills dst with output bytes [start, end) of a framed file, decoding from the start of
+// the frame holding start; a frame whose tokens don't add up to its header is corrupt
+void expandFrames(char *dst, uint64_t start, uint64_t end)
+{
+  long frame = findChunk(start);
+  uint64_t pos = chunkOffset[frame];
+  uint64_t at = frameStart[frame];
+  while (pos < end)
+  {
+    if (at == frameEnd[frame])
+    {
+      if (pos != chunkOffset[frame + 1])
+      {
+        corruptInput();
+      }
+      frame++;
+      at = frameStart[frame];
+      continue;
+    }
+    uint64_t token = readVarint(&at, frameEnd[frame]);
+    uint64_t length = token >> 1;
+    uint64_t data = at;
+    at += token & 1 ? length : 1;
+    if (at > frameEnd[frame] || length > UINT64_MAX - pos)
+    {
+      corruptInput();
+    }
+
+    // copy out the part of the token inside [start, end)
+    uint64_t from = pos > start ? pos : start;
+    uint64_t to = pos + length < end ? pos + length : end;
+    if (from < to && (token & 1))
+    {
+      memcpy(dst + (from - start), records + data + (from - pos), to - from);
+    }
+    else if (from < to)
+    {
+      memset(dst + (from - start), records[data], to - from);
+    }
+    pos += length;
+  }
+}
+
+// fills dst with output bytes [start, end)
+void expandRange(char *dst, uint64_t start, uint64_t end)
+{
+  if (framedInput)
+  {
+    expandFrames(dst, start, end);
+    return;
+  }
+  long lo = findChunk(start);
+
+  // skip the runs that end before start, then expand
+  long rec = lo * recordsPerChunk;
+  uint64_t pos = chunkOffset[lo];
+  while (pos + runLength(rec) <= start)
+  {
+    pos += runLength(rec);
+    rec++;
+  }
+  uint64_t at = start;
+  while (at < end)
+  {
+    uint64_t runEnd = pos + runLength(rec);
+    uint64_t stop = runEnd < end ? runEnd : end;
+    memset(dst, runChar(rec), stop - at);
+    dst += stop - at;
+    at = stop;
+    pos = runEnd;
+    rec++;
+  }
+}
+
+// each round, thread t expands slab t of the round into the round's buffer
+void *expandWorker(void *arg)
+{
+  long t = (long)arg;
+  for (long round = 0; round < numRounds; round++)
+  {
+    uint64_t start = outStart + ((uint64_t)round * totalTh + t) * SLAB_SIZE;
+    if (start < outEnd)
+    {
+      uint64_t end = start + SLAB_SIZE < outEnd ? start + SLAB_SIZE : outEnd;
+      expandRange(slabs[round % 2] + t * SLAB_SIZE, start, end);
+    }
+    pthread_barrier_wait(&roundDone);
+  }
+  return NULL;
+}
+
+void writeAll(char *data, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t written = write(STDOUT_FILENO, data, size);
+    if (written <= 0)
+    {
+      exit(1);
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+// expands output bytes [start, end) on all threads and writes them to stdout in order
+void writeRange(uint64_t start, uint64_t end)
+{
+  if (start >= end)
+  {
+    return;
+  }
+  outStart = start;
+  outEnd = end;
+  uint64_t roundSize = (uint64_t)totalTh * SLAB_SIZE;
+  numRounds = (end - start + roundSize - 1) / roundSize;
+
+  pthread_t tid[totalTh];
+  pthread_barrier_init(&roundDone, NULL, totalTh + 1);
+  for (long t = 0; t < totalTh; t++)
+  {
+    pthread_create(&tid[t], NULL, expandWorker, (void *)t);
+  }
+  // while the workers expand the next round into the other buffer, write this one
+  for (long round = 0; round < numRounds; round++)
+  {
+    pthread_barrier_wait(&roundDone);
+    uint64_t roundStart = start + round * roundSize;
+    uint64_t roundEnd = roundStart + roundSize < end ? roundStart + roundSize : end;
+    writeAll(slabs[round % 2], roundEnd - roundStart);
+  }
+  for (int t = 0; t < totalTh; t++)
+  {
+    pthread_join(tid[t], NULL);
+  }
+  pthread_barrier_destroy(&roundDone);
+}
+
+void writeIndex(char *indexName)
+{
+  FILE *index = fopen(indexName, "wb");
+  if (index == NULL)
+  {
+    printf("punzip: cannot open index\n");
+    exit(1);
+  }
+  uint32_t chunkRecords = recordsPerChunk;
+  uint64_t totalRecords = numRecords;
+  fwrite(INDEX_MAGIC, 4, 1, index);
+  fwrite(&chunkRecords, sizeof(chunkRecords), 1, index);
+  fwrite(&totalRecords, sizeof(totalRecords), 1, index);
+  fwrite(chunkOffset, sizeof(uint64_t), numChunks + 1, index);
+  fclose(index);
+}
+
+// loads the chunk offsets from an index written for this input
+void readIndex(char *indexName)
+{
+  FILE *index = fopen(indexName, "rb");
+  if (index == NULL)
+  {
+    printf("punzip: cannot open index\n");
+    exit(1);
+  }
+  char magic[4];
+  uint32_t chunkRecords;
+  uint64_t totalRecords;
+  if (fread(magic, 4, 1, index) != 1 || memcmp(magic, INDEX_MAGIC, 4) != 0
+      || fread(&chunkRecords, sizeof(chunkRecords), 1, index) != 1 || chunkRecords == 0
+      || fread(&totalRecords, sizeof(totalRecords), 1, index) != 1 || totalRecords != (uint64_t)numRecords)
+  {
+    printf("punzip: index does not match input\n");
+    exit(1);
+  }
+  recordsPerChunk = chunkRecords;
+  numChunks = (numRecords + recordsPerChunk - 1) / recordsPerChunk;
+  chunkOffset = realloc(chunkOffset, sizeof(uint64_t) * (numChunks + 1));
+  if (fread(chunkOffset, sizeof(uint64_t), numChunks + 1, index) != (size_t)(numChunks + 1))
+  {
+    printf("punzip: index does not match input\n");
+    exit(1);
+  }
+  fclose(index);
+}
+
+// maps a compressed file; in the record format a trailing partial record is ignored
+void openInput(char *fileName, size_t *mapSize)
+{
+  struct stat pd;
+  int file = open(fileName, O_RDONLY);
+  if (file == -1 || fstat(file, &pd) == -1)
+  {
+    printf("punzip: cannot open file\n");
+    exit(1);
+  }
+  *mapSize = pd.st_size;
+  numRecords = pd.st_size / RECORD_SIZE;
+  records = NULL;
+  if (pd.st_size > 0)
+  {
+    records = mmap(NULL, pd.st_size, PROT_READ, MAP_SHARED, file, 0);
+    if (records == MAP_FAILED)
+    {
+      close(file);
+      exit(1);
+    }
+    madvise(records, pd.st_size, MADV_SEQUENTIAL);
+  }
+  close(file);
+  inputSize = pd.st_size;
+  framedInput = pd.st_size >= FRAMED_MAGIC_SIZE && memcmp(records, FRAMED_MAGIC, FRAMED_MAGIC_SIZE) == 0;
+  if (framedInput)
+  {
+    scanFrames();
+    return;
+  }
+  recordsPerChunk = RECORDS_PER_CHUNK;
+  numChunks = (numRecords + recordsPerChunk - 1) / recordsPerChunk;
+  chunkOffset = realloc(chunkOffset, sizeof(uint64_t) * (numChunks + 1));
+  chunkOffset[0] = 0;
+}
+
+void usage()
+{
+  printf("punzip: [-w index] [-i index] [-r offset,length] file1 [file2 ...]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *writeIndexName = NULL;
+  char *readIndexName = NULL;
+  int hasRange = 0;
+  uint64_t rangeOffset = 0, rangeLength = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "w:i:r:")) != -1)
+  {
+    if (opt == 'w')
+    {
+      writeIndexName = optarg;
+    }
+    else if (opt == 'i')
+    {
+      readIndexName = optarg;
+    }
+    else if (opt == 'r' && sscanf(optarg, "%" SCNu64 ",%" SCNu64, &rangeOffset, &rangeLength) == 2)
+    {
+      hasRange = 1;
+    }
+    else
+    {
+      usage();
+    }
+  }
+
+  // validate arguments: the index and range options work on a single file
+  if (optind >= argc || ((writeIndexName || readIndexName || hasRange) && argc - optind != 1)
+      || (readIndexName && !hasRange))
+  {
+    usage();
+  }
+
+  totalTh = get_nprocs();
+  slabs[0] = malloc((size_t)totalTh * SLAB_SIZE);
+  slabs[1] = malloc((size_t)totalTh * SLAB_SIZE);
+
+  for (int i = optind; i < argc; i++)
+  {
+    size_t mapSize;
+    openInput(argv[i], &mapSize);
+    if (framedInput && (readIndexName || writeIndexName))
+    {
+      printf("punzip: framed input needs no index\n");
+      exit(1);
+    }
+    else if (readIndexName)
+    {
+      readIndex(readIndexName);
+    }
+    else if (!framedInput)
+    {
+      computeChunkOffsets();
+    }
+    if (writeIndexName)
+    {
+      writeIndex(writeIndexName);
+    }
+
+    uint64_t total = chunkOffset[numChunks];
+    if (hasRange)
+    {
+      uint64_t start = rangeOffset < total ? rangeOffset : total;
+      uint64_t end = rangeLength < total - start ? start + rangeLength : total;
+      writeRange(start, end);
+    }
+    else
+    {
+      writeRange(0, total);
+    }
+
+    if (records != NULL)
+    {
+      munmap(records, mapSize);
+    }
+  }
+
+  return 0;
+}
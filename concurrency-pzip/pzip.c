@@ -1,6 +1,11 @@
+#define _GNU_SOURCE // for CPU affinity
 #include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
+#include <stdint.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <sys/stat.h>
 #include <sys/sysinfo.h>
 #include <stdio.h>
@@ -8,279 +13,1341 @@
 #include <string.h>
 #include <pthread.h>
 
-#define QUEUE_SIZE 10
-int queueSize, queueHead, queueTail = 0;
+#define DEFAULT_QUEUE_SIZE 64 // must be a power of two, and at least 2 so a full cell
+                              // and an empty one have different sequence numbers
+#define MAX_QUEUE_SIZE (1 << 20)
+#define DEFAULT_CHUNK_SIZE (1 << 20)
+#define MAX_THREADS 1024
+#define CACHE_LINE 64
+#define SMALL_FILE_SIZE (64 << 10) // files up to this size are read, batched, not mapped
+#define PREFETCH_CHUNKS 4 // how far ahead of the chunk being queued to ask for readahead
+#define URING_DEPTH 8 // reads each producer keeps in flight with the uring engine
+#define QUEUE_SPINS 64 // failed queue tries, with a yield after each, before a thread parks
 
-int totalTh;
+// how producers get big files into memory, set with -i
+#define ENGINE_MMAP 0 // map the file and let consumers fault it in
+#define ENGINE_READ 1 // pread each chunk into its own buffer
+#define ENGINE_URING 2 // keep URING_DEPTH chunk reads in flight with io_uring
+int inputEngine = ENGINE_MMAP;
+
+// The framed format, picked with -f (see wzip.c for the layout): a header, then frames of
+// [varint payload bytes][varint decoded bytes] and run or literal tokens. Each chunk becomes
+// one frame, so punzip can place every frame's output without decoding the tokens.
+#define FRAMED_MAGIC "\0\0\0\0WZV1"
+#define MIN_RUN 3 // shorter runs go into literal blocks
+#define LITERAL_MAX 8191 // largest literal block whose header fits in two varint bytes
+int framedOutput = 0;
+
+// Threads and where they run, set with -t, -q, -a and -n, or else with the PZIP_THREADS,
+// PZIP_QUEUE, PZIP_CPUS and PZIP_NUMA environment variables. Pinned threads take the CPUs
+// of cpuList in order, producers first, so with enough CPUs the consumers don't share
+// theirs with a producer. In NUMA mode the list defaults to the CPUs node by node, and each
+// consumer compresses straight into body buffers of its own (see BodyPool).
+int totalTh; // consumers
+int queueSize;
+int *cpuList; // NULL if threads aren't pinned
+int numCpus;
+int numaMode = 0;
+
+// NUMA mode: a consumer's body buffers. Each is mmapped by the consumer, which is pinned, so
+// the pages are first touched when it compresses into them and sit on its node. The writer
+// pushes a buffer back onto returned once it's written, and the consumer takes them all at
+// once when it runs out, so a buffer only ever holds that consumer's output.
+struct BodyBuffer
+{
+  struct BodyBuffer *next;
+};
+
+struct BodyPool
+{
+  struct BodyBuffer *returned; // pushed by the writer
+  struct BodyBuffer *free;     // the consumer's own
+};
+
+__thread struct BodyPool *bodyPool; // NULL unless in NUMA mode
+int numProducers;
 int numFiles;
-int isComplete = 0;
+char **fileNames;
+int producersDone = 0;
 
-int totalPages;
-int pageSize; // keep in mind pageSize = 4096 Bytes
-int *pagesPerFile;
+// The input in file order, as the producers see it: either one file big enough to be
+// mapped and split into chunks, or a batch of consecutive small files read into a single
+// chunk, so tiny files don't cost an mmap and a queue round-trip each.
+struct FileGroup
+{
+  int firstFile;
+  int numFiles;
+  int batched;
+  size_t size; // of the file, or of all the batch's files together
+  long firstChunk; // prefix sum of the chunks of the groups before this one
+};
+
+struct FileGroup *groups;
+int numGroups;
+int nextGroup = 0; // next group for a producer to take, taken atomically
 
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t fileLock = PTHREAD_MUTEX_INITIALIZER;
+long totalChunks;
+int chunkSize; // bytes of input per work item, set with -c
+off_t *fileSizes;
+long pageSize;
 
-pthread_cond_t empty = PTHREAD_COND_INITIALIZER;
-pthread_cond_t fill = PTHREAD_COND_INITIALIZER;
+// a mapped file, unmapped by whichever consumer finishes its last chunk
+struct Mapping
+{
+  char *address;
+  size_t size;
+  long chunksLeft;
+};
 
 // used for the data for each file
 struct Buffer
 {
-  int fileNum;
-  int pageNum;
-  int lastPageSize;
-  char *address; // FN + PN
-} buffer[QUEUE_SIZE];
+  long chunkIndex; // position of the chunk in the whole input, across files
+  int size;
+  char *address;
+  struct Mapping *mapping; // NULL for a batch, whose address is a malloced buffer
+};
+
+// Lock-free bounded multi-producer multi-consumer queue (Dmitry Vyukov's design). Each
+// cell's sequence number says whose turn it is: a producer may fill the cell at position
+// pos when sequence == pos, and a consumer may empty it when sequence == pos + 1. Producers
+// and consumers only contend on their own position counter, with one CAS per operation.
+struct Cell
+{
+  size_t sequence;
+  struct Buffer buff;
+};
 
+struct Cell *queue; // queueSize cells
+size_t enqueuePos __attribute__((aligned(CACHE_LINE)));
+size_t dequeuePos __attribute__((aligned(CACHE_LINE)));
+
+// Threads that found the queue empty or full for QUEUE_SPINS tries sleep on these instead of
+// spinning, so idle consumers leave their cores to the producers and the writer. A waiter
+// counts itself before it checks the queue a last time, and the other side checks the count
+// after it changes the queue, so with a fence on each side one of them always sees the other.
+pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queueNotEmpty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t queueNotFull = PTHREAD_COND_INITIALIZER;
+int emptyWaiters __attribute__((aligned(CACHE_LINE)));
+int fullWaiters;
+
+// A compressed chunk. Its first and last runs are kept apart from the body so the writer
+// can merge them with the runs of the neighbouring chunks; the body holds every run in
+// between, already in the output format: [int count][char] records, or framed tokens.
 struct Output
 {
-  char *data;
-  int *count;
-  int size;
-} *out;
+  char *body;
+  size_t bodySize;
+  size_t bodyBytes; // input bytes the body stands for, which a frame header records
+  int numRuns;
+  int firstCount;
+  char firstChar;
+  int lastCount;
+  char lastChar;
+  struct BodyPool *pool; // the pool body goes back to, or NULL if it's malloced
+  int ready;
+};
+
+// Reorder window: compressed chunks wait here, in the slot for chunkIndex % windowSize,
+// until every earlier chunk has been written. Producers don't enqueue a chunk more than
+// windowSize ahead of the writer, which bounds memory by the window, not the input size.
+struct Output *window;
+int windowSize;
+long writtenChunks = 0;
+pthread_mutex_t windowLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t chunkReady = PTHREAD_COND_INITIALIZER;
+pthread_cond_t chunkWritten = PTHREAD_COND_INITIALIZER;
+
+void initQueue()
+{
+  // aligned_alloc wants a whole number of cache lines, which small queues don't fill
+  size_t queueBytes = (sizeof(struct Cell) * queueSize + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+  queue = aligned_alloc(CACHE_LINE, queueBytes);
+  for (int i = 0; i < queueSize; i++)
+  {
+    queue[i].sequence = i;
+  }
+  enqueuePos = 0;
+  dequeuePos = 0;
+}
+
+int tryEnqueue(struct Buffer *buff) // returns 0 if the queue is full
+{
+  size_t pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+  while (1)
+  {
+    struct Cell *cell = &queue[pos & (queueSize - 1)];
+    size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0)
+    {
+      if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        cell->buff = *buff;
+        __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    }
+    else if (diff < 0)
+    {
+      return 0;
+    }
+    else
+    {
+      pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+int tryDequeue(struct Buffer *buff) // returns 0 if the queue is empty
+{
+  size_t pos = __atomic_load_n(&dequeuePos, __ATOMIC_RELAXED);
+  while (1)
+  {
+    struct Cell *cell = &queue[pos & (queueSize - 1)];
+    size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0)
+    {
+      if (__atomic_compare_exchange_n(&dequeuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        *buff = cell->buff;
+        __atomic_store_n(&cell->sequence, pos + queueSize, __ATOMIC_RELEASE);
+        return 1;
+      }
+    }
+    else if (diff < 0)
+    {
+      return 0;
+    }
+    else
+    {
+      pos = __atomic_load_n(&dequeuePos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// wakes a thread sleeping on cond, if there is one; the lock-free path when there isn't
+void wakeWaiter(int *waiters, pthread_cond_t *cond)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0)
+  {
+    pthread_mutex_lock(&queueLock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&queueLock);
+  }
+}
+
+// blocks until the chunk is no more than a window ahead of the writer
+void waitForWindow(long chunkIndex)
+{
+  pthread_mutex_lock(&windowLock);
+  while (chunkIndex >= writtenChunks + windowSize)
+  {
+    pthread_cond_wait(&chunkWritten, &windowLock);
+  }
+  pthread_mutex_unlock(&windowLock);
+}
+
+int windowHasRoom(long chunkIndex)
+{
+  return chunkIndex < __atomic_load_n(&writtenChunks, __ATOMIC_RELAXED) + windowSize;
+}
+
+void enqueueChunk(struct Buffer *tp)
+{
+  waitForWindow(tp->chunkIndex);
 
-void enqueue(struct Buffer buff) // insert at queueHead index of queue
+  // consumers are behind: let them run, and sleep if they stay behind
+  for (int tries = 0; !tryEnqueue(tp); tries++)
+  {
+    if (tries < QUEUE_SPINS)
+    {
+      sched_yield();
+      continue;
+    }
+    pthread_mutex_lock(&queueLock);
+    __atomic_fetch_add(&fullWaiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (!tryEnqueue(tp))
+    {
+      pthread_cond_wait(&queueNotFull, &queueLock);
+    }
+    __atomic_fetch_sub(&fullWaiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&queueLock);
+    break;
+  }
+  wakeWaiter(&emptyWaiters, &queueNotEmpty);
+}
+
+// takes the next chunk off the queue, sleeping while it's empty; returns 0 once the
+// producers are done and the queue is empty
+int dequeueChunk(struct Buffer *buff)
 {
-  buffer[queueHead] = buff;
-  queueHead = (queueHead + 1) % QUEUE_SIZE;
-  queueSize++;
+  int found = 0;
+  for (int tries = 0; tries < QUEUE_SPINS && !found; tries++)
+  {
+    found = tryDequeue(buff);
+    // check the queue again after seeing the producers finish, since their last chunks
+    // may have landed in between
+    if (!found && __atomic_load_n(&producersDone, __ATOMIC_ACQUIRE) == numProducers)
+    {
+      if (!tryDequeue(buff))
+      {
+        return 0;
+      }
+      found = 1;
+    }
+    if (!found)
+    {
+      sched_yield();
+    }
+  }
+
+  if (!found)
+  {
+    pthread_mutex_lock(&queueLock);
+    __atomic_fetch_add(&emptyWaiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (!(found = tryDequeue(buff)))
+    {
+      if (__atomic_load_n(&producersDone, __ATOMIC_ACQUIRE) == numProducers)
+      {
+        found = tryDequeue(buff);
+        break;
+      }
+      pthread_cond_wait(&queueNotEmpty, &queueLock);
+    }
+    __atomic_fetch_sub(&emptyWaiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&queueLock);
+  }
+
+  if (found)
+  {
+    wakeWaiter(&fullWaiters, &queueNotFull);
+  }
+  return found;
 }
 
-struct Buffer dequeue() // remove at queueTail index of queue
+size_t chunkBytes(struct FileGroup *group, long j)
 {
-  struct Buffer buff = buffer[queueTail];
-  queueTail = (queueTail + 1) % QUEUE_SIZE;
-  queueSize--;
-  return buff;
+  size_t offset = (size_t)j * chunkSize;
+  return group->size - offset < (size_t)chunkSize ? group->size - offset : (size_t)chunkSize;
 }
 
-// helper to map pages and enqueue them
-void helper(char *mapAddress, int pagesInFile, int lastPageSize, int i)
+void readFully(int file, char *buf, size_t size, off_t offset)
 {
-  for (int j = 0; j < pagesInFile; j++)
+  size_t done = 0;
+  while (done < size)
   {
-    pthread_mutex_lock(&lock);
-    while (queueSize == QUEUE_SIZE)
+    ssize_t got = pread(file, buf + done, size - done, offset + done);
+    if (got <= 0)
     {
-      pthread_cond_broadcast(&fill);
-      pthread_cond_wait(&empty, &lock);
+      exit(1);
     }
-    pthread_mutex_unlock(&lock);
+    done += got;
+  }
+}
 
+// maps a big file, splits it into chunks and enqueues them
+void mapFile(struct FileGroup *group)
+{
+  int file = open(fileNames[group->firstFile], O_RDONLY);
+
+  // use mmap to map the entire file
+  char *mapAddress = mmap(NULL, group->size, PROT_READ, MAP_SHARED, file, 0);
+  close(file);
+  if (mapAddress == MAP_FAILED)
+  {
+    exit(1);
+  }
+  madvise(mapAddress, group->size, MADV_SEQUENTIAL);
+
+  long chunksInFile = (group->size + chunkSize - 1) / chunkSize;
+  struct Mapping *mapping = malloc(sizeof(struct Mapping));
+  mapping->address = mapAddress;
+  mapping->size = group->size;
+  mapping->chunksLeft = chunksInFile;
+
+  for (long j = 0; j < chunksInFile; j++)
+  {
     struct Buffer tp;
-    if (j == pagesInFile - 1)
+    tp.size = chunkBytes(group, j);
+    tp.chunkIndex = group->firstChunk + j;
+    tp.address = mapAddress + (size_t)j * chunkSize;
+    tp.mapping = mapping;
+
+    // start reading ahead so consumers don't stall on major faults one page at a time
+    if (j + PREFETCH_CHUNKS < chunksInFile)
     {
-      tp.lastPageSize = lastPageSize;
+      char *ahead = mapAddress + (size_t)(j + PREFETCH_CHUNKS) * chunkSize;
+      uintptr_t start = (uintptr_t)ahead & ~(pageSize - 1);
+      madvise((void *)start, chunkBytes(group, j + PREFETCH_CHUNKS) + ((uintptr_t)ahead - start), MADV_WILLNEED);
     }
-    else
+    enqueueChunk(&tp);
+  }
+}
+
+// reads a big file one chunk at a time into buffers the consumers free; the kernel reads
+// ahead while the chunks already queued are compressed
+void readFile(struct FileGroup *group)
+{
+  int file = open(fileNames[group->firstFile], O_RDONLY);
+  posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+  long chunksInFile = (group->size + chunkSize - 1) / chunkSize;
+  for (long j = 0; j < chunksInFile; j++)
+  {
+    struct Buffer tp;
+    tp.size = chunkBytes(group, j);
+    tp.chunkIndex = group->firstChunk + j;
+    tp.mapping = NULL;
+    if (j + PREFETCH_CHUNKS < chunksInFile)
     {
-      tp.lastPageSize = pageSize;
+      posix_fadvise(file, (off_t)(j + PREFETCH_CHUNKS) * chunkSize, chunkBytes(group, j + PREFETCH_CHUNKS), POSIX_FADV_WILLNEED);
     }
 
-    tp.pageNum = j;
-    tp.fileNum = i;
-    tp.address = mapAddress;
+    // wait for room before reading so a blocked producer doesn't hold a full buffer
+    waitForWindow(tp.chunkIndex);
+    tp.address = malloc(tp.size);
+    readFully(file, tp.address, tp.size, (off_t)j * chunkSize);
+    enqueueChunk(&tp);
+  }
+  close(file);
+}
+
+// A minimal io_uring, set up with raw system calls since liburing may not be installed.
+// Each producer has its own ring, so nothing here is shared between threads.
+struct Uring
+{
+  int fd;
+  unsigned *sqTail;
+  unsigned *sqMask;
+  unsigned *sqArray;
+  struct io_uring_sqe *sqes;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned *cqMask;
+  struct io_uring_cqe *cqes;
+};
+
+__thread struct Uring ring;
+__thread int ringReady = 0; // 1 once set up, -1 if io_uring isn't available
 
-    mapAddress += pageSize;
+int uringSetup()
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring.fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+  if (ring.fd < 0)
+  {
+    return -1;
+  }
 
-    pthread_mutex_lock(&lock);
-    enqueue(tp);
-    pthread_mutex_unlock(&lock);
-    pthread_cond_signal(&fill);
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+  }
+  char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  char *cq = sq;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED)
+  {
+    cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+  }
+  ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED)
+  {
+    close(ring.fd);
+    return -1;
   }
+
+  ring.sqTail = (unsigned *)(sq + params.sq_off.tail);
+  ring.sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring.sqArray = (unsigned *)(sq + params.sq_off.array);
+  ring.cqHead = (unsigned *)(cq + params.cq_off.head);
+  ring.cqTail = (unsigned *)(cq + params.cq_off.tail);
+  ring.cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
 }
 
-// producer function
-void *producer(void *arg)
+// queues a read of size bytes at offset into buf; the caller submits with io_uring_enter
+void uringPrepRead(int file, char *buf, size_t size, off_t offset, int slot)
 {
-  char **filenames = (char **)arg;
-  struct stat pd;
-  char *mapAddress;
-  int file;
+  unsigned tail = *ring.sqTail;
+  unsigned index = tail & *ring.sqMask;
+  struct io_uring_sqe *sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = file;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = size;
+  sqe->off = offset;
+  sqe->user_data = slot;
+  ring.sqArray[index] = index;
+  __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+}
 
-  for (int i = 0; i < numFiles; i++)
+// reads a big file with up to URING_DEPTH chunk reads in flight, queueing each chunk as
+// its read completes; falls back to readFile if the kernel has no io_uring
+void uringReadFile(struct FileGroup *group)
+{
+  if (ringReady == 0)
+  {
+    ringReady = uringSetup() == 0 ? 1 : -1;
+  }
+  if (ringReady < 0)
   {
-    file = open(filenames[i], O_RDONLY);
-    int pagesInFile = 0;
-    int lastPageSize = 0;
+    readFile(group);
+    return;
+  }
 
-    // file validation
-    if (fstat(file, &pd) == -1)
+  int file = open(fileNames[group->firstFile], O_RDONLY);
+  posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+  long chunksInFile = (group->size + chunkSize - 1) / chunkSize;
+  struct Buffer inFlight[URING_DEPTH];
+  int freeSlots[URING_DEPTH];
+  int numFree = URING_DEPTH;
+  for (int k = 0; k < URING_DEPTH; k++)
+  {
+    freeSlots[k] = k;
+  }
+
+  long next = 0;
+  while (next < chunksInFile || numFree < URING_DEPTH)
+  {
+    // only start reads the window has room for, so every read in flight can be queued
+    // without waiting on a chunk that is itself still in flight
+    if (numFree == URING_DEPTH && next < chunksInFile)
+    {
+      waitForWindow(group->firstChunk + next);
+    }
+    int toSubmit = 0;
+    while (numFree > 0 && next < chunksInFile && windowHasRoom(group->firstChunk + next))
+    {
+      int slot = freeSlots[--numFree];
+      struct Buffer *tp = &inFlight[slot];
+      tp->size = chunkBytes(group, next);
+      tp->chunkIndex = group->firstChunk + next;
+      tp->address = malloc(tp->size);
+      tp->mapping = NULL;
+      uringPrepRead(file, tp->address, tp->size, (off_t)next * chunkSize, slot);
+      next++;
+      toSubmit++;
+    }
+    if (syscall(__NR_io_uring_enter, ring.fd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
     {
-      close(file);
       exit(1);
     }
-    if (pd.st_size == 0)
+
+    unsigned head = *ring.cqHead;
+    while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+    {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+      int slot = cqe->user_data;
+      int res = cqe->res;
+      struct Buffer *tp = &inFlight[slot];
+      // finish short or failed reads (e.g. a kernel without IORING_OP_READ) synchronously
+      size_t done = res > 0 ? res : 0;
+      readFully(file, tp->address + done, tp->size - done, (off_t)(tp->chunkIndex - group->firstChunk) * chunkSize + done);
+      enqueueChunk(tp);
+      freeSlots[numFree++] = slot;
+      head++;
+    }
+    __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+  }
+  close(file);
+}
+
+// reads a batch of small files back to back into one buffer and enqueues it as one chunk
+void readBatch(struct FileGroup *group)
+{
+  struct Buffer tp;
+  tp.chunkIndex = group->firstChunk;
+  tp.size = group->size;
+  tp.address = malloc(group->size);
+  tp.mapping = NULL;
+
+  char *next = tp.address;
+  for (int i = group->firstFile; i < group->firstFile + group->numFiles; i++)
+  {
+    if (fileSizes[i] == 0)
     {
       continue;
     }
+    int file = open(fileNames[i], O_RDONLY);
+    readFully(file, next, fileSizes[i], 0);
+    close(file);
+    next += fileSizes[i];
+  }
+  enqueueChunk(&tp);
+}
 
-    // page alignment
-    pagesInFile = (pd.st_size / pageSize);
-    if (((double)pd.st_size / pageSize) > pagesInFile)
+// producer function: producers take groups off the list until it runs out, so several
+// files are mapped or read at once
+void *producer(void *arg)
+{
+  int i;
+  while ((i = __atomic_fetch_add(&nextGroup, 1, __ATOMIC_RELAXED)) < numGroups)
+  {
+    if (groups[i].batched)
+    {
+      readBatch(&groups[i]);
+    }
+    else if (inputEngine == ENGINE_URING)
+    {
+      uringReadFile(&groups[i]);
+    }
+    else if (inputEngine == ENGINE_READ)
     {
-      pagesInFile += 1;
-      lastPageSize = pd.st_size % pageSize;
+      readFile(&groups[i]);
     }
     else
     {
-      lastPageSize = pageSize;
+      mapFile(&groups[i]);
     }
-    totalPages += pagesInFile;
-    pagesPerFile[i] = pagesInFile;
+  }
+
+  __atomic_fetch_add(&producersDone, 1, __ATOMIC_RELEASE);
+
+  // consumers asleep on an empty queue have to wake to see it
+  pthread_mutex_lock(&queueLock);
+  pthread_cond_broadcast(&queueNotEmpty);
+  pthread_mutex_unlock(&queueLock);
+  return 0;
+}
+
+// Run scanning. Every kernel finds where runs end and hands each run to addRun, which
+// keeps the chunk's first and last runs aside and writes the rest straight into the body.
+// The vector kernels compare 16 or 32 bytes against the same bytes shifted by one, so each
+// set bit of the movemask is a run boundary: long runs cost one compare per block, and
+// short runs cost one ctz per run instead of a branch per byte.
+struct RunWriter
+{
+  struct Output *compressedOutput;
+  char *output;
+  int numRuns;
+  int framed;
+  char *literal; // header of the open literal block, framed only
+  int literalLength; // 0 if no literal block is open
+};
 
-    // use mmap to map the entire file
-    mapAddress = mmap(NULL, pd.st_size, PROT_READ, MAP_SHARED, file, 0);
+static inline void putVarint(struct RunWriter *w, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    *w->output++ = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  *w->output++ = value;
+}
 
-    if (mapAddress == MAP_FAILED)
+// fills in the two-byte header of the open literal block, if any
+static inline void closeLiteral(struct RunWriter *w)
+{
+  if (w->literalLength > 0)
+  {
+    unsigned int value = (w->literalLength << 1) | 1;
+    w->literal[0] = (value & 0x7f) | 0x80;
+    w->literal[1] = value >> 7;
+    w->literalLength = 0;
+  }
+}
+
+// writes a run to the output in the chosen format
+static inline void putRun(struct RunWriter *w, int count, char character)
+{
+  if (!w->framed)
+  {
+    memcpy(w->output, &count, sizeof(int));
+    w->output[sizeof(int)] = character;
+    w->output += sizeof(int) + sizeof(char);
+  }
+  else if (count >= MIN_RUN)
+  {
+    closeLiteral(w);
+    putVarint(w, (uint64_t)count << 1);
+    *w->output++ = character;
+  }
+  else
+  {
+    for (int i = 0; i < count; i++)
     {
-      close(file);
-      exit(1);
+      if (w->literalLength == 0 || w->literalLength == LITERAL_MAX)
+      {
+        closeLiteral(w);
+        w->literal = w->output;
+        w->output += 2;
+      }
+      *w->output++ = character;
+      w->literalLength++;
     }
+  }
+}
 
-    // helper to map pages and enqueue them
-    helper(mapAddress, pagesInFile, lastPageSize, i);
+static inline void addRun(struct RunWriter *w, int count, char character)
+{
+  struct Output *o = w->compressedOutput;
+  if (w->numRuns == 0)
+  {
+    o->firstCount = count;
+    o->firstChar = character;
+  }
+  else if (w->numRuns > 1)
+  {
+    // the previous run wasn't the first or the last, so it goes in the body
+    putRun(w, o->lastCount, o->lastChar);
+  }
+  o->lastCount = count;
+  o->lastChar = character;
+  w->numRuns++;
+}
 
-    close(file);
+// finishes the runs from runStart on one byte at a time; the last run ends at size
+static inline void scanTail(const char *in, int size, int k, int runStart, struct RunWriter *w)
+{
+  for (; k < size - 1; k++)
+  {
+    if (in[k] != in[k + 1])
+    {
+      addRun(w, k + 1 - runStart, in[k]);
+      runStart = k + 1;
+    }
   }
+  addRun(w, size - runStart, in[size - 1]);
+}
 
-  isComplete = 1;
-  pthread_cond_broadcast(&fill);
-  return 0;
+// adds a run for each set bit of a block's boundary mask; bit b means in[k + b] ends a run
+static inline int addBoundaries(const char *in, int k, unsigned int mask, int runStart, struct RunWriter *w)
+{
+  while (mask != 0)
+  {
+    int end = k + __builtin_ctz(mask);
+    addRun(w, end + 1 - runStart, in[end]);
+    runStart = end + 1;
+    mask &= mask - 1;
+  }
+  return runStart;
 }
 
-struct Output compress(struct Buffer curr)
+void scanRunsScalar(const char *in, int size, struct RunWriter *w)
 {
-  struct Output compressedOutput;
-  compressedOutput.count = malloc(curr.lastPageSize * sizeof(int));
-  char *tempString = malloc(curr.lastPageSize);
-  int countIndex = 0;
+  scanTail(in, size, 0, 0, w);
+}
 
-  for (int i = 0; i < curr.lastPageSize; i++)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2"))) void scanRunsSse2(const char *in, int size, struct RunWriter *w)
+{
+  int runStart = 0;
+  int k = 0;
+  for (; k + 16 < size; k += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(in + k));
+    __m128i b = _mm_loadu_si128((const __m128i *)(in + k + 1));
+    unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xFFFF;
+    runStart = addBoundaries(in, k, mask, runStart, w);
+  }
+  scanTail(in, size, k, runStart, w);
+}
+
+__attribute__((target("avx2"))) void scanRunsAvx2(const char *in, int size, struct RunWriter *w)
+{
+  int runStart = 0;
+  int k = 0;
+  for (; k + 32 < size; k += 32)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(in + k));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(in + k + 1));
+    unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+    runStart = addBoundaries(in, k, mask, runStart, w);
+  }
+  scanTail(in, size, k, runStart, w);
+}
+#endif
+
+void (*scanRuns)(const char *in, int size, struct RunWriter *w) = scanRunsScalar;
+
+// picks the widest kernel the CPU supports
+void chooseKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
   {
-    tempString[countIndex] = curr.address[i];
-    compressedOutput.count[countIndex] = 1;
+    scanRuns = scanRunsAvx2;
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    scanRuns = scanRunsSse2;
+  }
+#endif
+}
 
-    while (i + 1 < curr.lastPageSize && curr.address[i] == curr.address[i + 1])
+// a body buffer from this consumer's pool, mapping a new one if none has come back
+char *takeBody()
+{
+  if (bodyPool->free == NULL)
+  {
+    bodyPool->free = __atomic_exchange_n(&bodyPool->returned, NULL, __ATOMIC_ACQUIRE);
+  }
+  struct BodyBuffer *buffer = bodyPool->free;
+  if (buffer == NULL)
+  {
+    buffer = mmap(NULL, (size_t)chunkSize * (sizeof(int) + sizeof(char)), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
     {
-      compressedOutput.count[countIndex]++;
-      i++;
+      exit(1);
     }
-    countIndex++;
+    return (char *)buffer;
+  }
+  bodyPool->free = buffer->next;
+  return (char *)buffer;
+}
+
+// hands a written body back to the consumer it came from
+void returnBody(struct Output *curr)
+{
+  struct BodyBuffer *buffer = (struct BodyBuffer *)curr->body;
+  buffer->next = __atomic_load_n(&curr->pool->returned, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&curr->pool->returned, &buffer->next, buffer, 1, __ATOMIC_RELEASE,
+                                      __ATOMIC_RELAXED))
+  {
+  }
+}
+
+void compress(struct Buffer curr, struct Output *compressedOutput)
+{
+  char *body = bodyPool != NULL ? takeBody() : malloc((size_t)curr.size * (sizeof(int) + sizeof(char)));
+  struct RunWriter w = {compressedOutput, body, 0, framedOutput, NULL, 0};
+  scanRuns(curr.address, curr.size, &w);
+  closeLiteral(&w);
+  compressedOutput->numRuns = w.numRuns;
+  compressedOutput->bodySize = w.output - body;
+  compressedOutput->bodyBytes = w.numRuns > 1 ? curr.size - compressedOutput->firstCount - compressedOutput->lastCount : 0;
+  compressedOutput->pool = bodyPool;
+  if (bodyPool != NULL)
+  {
+    compressedOutput->body = body;
+  }
+  else
+  {
+    compressedOutput->body = realloc(body, compressedOutput->bodySize + 1);
+  }
+}
+
+// gives the pages of a compressed chunk back to the page cache, so resident memory doesn't
+// grow with the input; only whole pages inside the chunk are released
+void releaseChunk(struct Buffer curr)
+{
+  uintptr_t start = ((uintptr_t)curr.address + pageSize - 1) & ~(pageSize - 1);
+  uintptr_t end = ((uintptr_t)curr.address + curr.size) & ~(pageSize - 1);
+  if (end > start)
+  {
+    madvise((void *)start, end - start, MADV_DONTNEED);
   }
-  compressedOutput.size = countIndex;
-  compressedOutput.data = realloc(tempString, countIndex);
-  return compressedOutput;
 }
 
 // consumer function
-void *consumer()
+void *consumer(void *pool)
 {
-  do
+  struct Buffer curr;
+  bodyPool = pool;
+  // until the producers are done and the queue is empty
+  while (dequeueChunk(&curr))
   {
-    pthread_mutex_lock(&lock);
-    while (queueSize == 0 && isComplete == 0)
+
+    // compress buffer, then let go of its input
+    struct Output compressedOutput;
+    compress(curr, &compressedOutput);
+    if (curr.mapping == NULL)
+    {
+      free(curr.address);
+    }
+    else if (__atomic_sub_fetch(&curr.mapping->chunksLeft, 1, __ATOMIC_ACQ_REL) == 0)
     {
-      pthread_cond_signal(&empty);
-      // start filling queue
-      pthread_cond_wait(&fill, &lock);
+      munmap(curr.mapping->address, curr.mapping->size);
+      free(curr.mapping);
     }
-    // producer done mapping and queue is empty, exit
-    if (isComplete == 1 && queueSize == 0)
+    else
     {
-      pthread_mutex_unlock(&lock);
-      return NULL;
+      releaseChunk(curr);
     }
 
-    // get next buffer from queue
-    struct Buffer curr = dequeue();
+    // hand it to the writer
+    pthread_mutex_lock(&windowLock);
+    compressedOutput.ready = 1;
+    window[curr.chunkIndex % windowSize] = compressedOutput;
+    if (curr.chunkIndex == writtenChunks)
+    {
+      pthread_cond_signal(&chunkReady);
+    }
+    pthread_mutex_unlock(&windowLock);
+  }
+
+  return NULL;
+}
+
+void writeRunToStdout(int count, char character)
+{
+  fwrite(&count, sizeof(int), 1, stdout);
+  fputc(character, stdout);
+}
 
-    if (isComplete == 0)
+// writes one frame: the runs the writer held back, as tokens, then the chunk's body
+void writeFrame(int *counts, char *chars, int numRuns, struct Output *curr)
+{
+  char prefix[64];
+  struct RunWriter w = {NULL, prefix, 0, 1, NULL, 0};
+  uint64_t decoded = 0;
+  for (int i = 0; i < numRuns; i++)
+  {
+    putRun(&w, counts[i], chars[i]);
+    decoded += counts[i];
+  }
+  closeLiteral(&w);
+  size_t prefixSize = w.output - prefix;
+  size_t bodySize = curr != NULL ? curr->bodySize : 0;
+  decoded += curr != NULL ? curr->bodyBytes : 0;
+  if (prefixSize + bodySize == 0)
+  {
+    return;
+  }
+
+  char header[20];
+  w.output = header;
+  putVarint(&w, prefixSize + bodySize);
+  putVarint(&w, decoded);
+  fwrite(header, w.output - header, 1, stdout);
+  fwrite(prefix, prefixSize, 1, stdout);
+  if (bodySize > 0)
+  {
+    fwrite(curr->body, bodySize, 1, stdout);
+  }
+}
+
+// writes the chunks out in order as they finish, holding back the last run written so far
+// in case the next chunk starts with the same character
+void writeCompressedOutput()
+{
+  int pendingCount = 0;
+  char pendingChar = 0;
+  if (framedOutput)
+  {
+    fwrite(FRAMED_MAGIC, sizeof(FRAMED_MAGIC) - 1, 1, stdout);
+  }
+  for (long i = 0; i < totalChunks; i++)
+  {
+    struct Output *curr = &window[i % windowSize];
+    pthread_mutex_lock(&windowLock);
+    while (!curr->ready)
     {
-      pthread_cond_signal(&empty);
+      pthread_cond_wait(&chunkReady, &windowLock);
     }
-    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&windowLock);
 
-    // find output position for buffer
-    int pos = 0;
-    for (int i = 0; i < curr.fileNum; i++)
+    if (pendingCount > 0 && pendingChar == curr->firstChar)
     {
-      pos += pagesPerFile[i];
+      curr->firstCount += pendingCount;
+      if (curr->numRuns == 1)
+      {
+        curr->lastCount = curr->firstCount;
+      }
+    }
+    else if (pendingCount > 0 && !framedOutput)
+    {
+      writeRunToStdout(pendingCount, pendingChar);
+    }
+    if (framedOutput)
+    {
+      // the pending run, unless it merged into this chunk, and the first run open the frame
+      int counts[2], numRuns = 0;
+      char chars[2];
+      if (pendingCount > 0 && pendingChar != curr->firstChar)
+      {
+        counts[numRuns] = pendingCount;
+        chars[numRuns++] = pendingChar;
+      }
+      if (curr->numRuns > 1)
+      {
+        counts[numRuns] = curr->firstCount;
+        chars[numRuns++] = curr->firstChar;
+      }
+      writeFrame(counts, chars, numRuns, curr->numRuns > 1 ? curr : NULL);
+    }
+    else if (curr->numRuns > 1)
+    {
+      writeRunToStdout(curr->firstCount, curr->firstChar);
+      fwrite(curr->body, curr->bodySize, 1, stdout);
+    }
+    pendingCount = curr->lastCount;
+    pendingChar = curr->lastChar;
+    if (curr->pool != NULL)
+    {
+      returnBody(curr);
+    }
+    else
+    {
+      free(curr->body);
     }
-    pos += curr.pageNum;
 
-    // compress buffer
-    struct Output compressedOutput = compress(curr);
-    out[pos] = compressedOutput;
+    // free the slot and let producers move the window along
+    pthread_mutex_lock(&windowLock);
+    curr->ready = 0;
+    __atomic_store_n(&writtenChunks, writtenChunks + 1, __ATOMIC_RELAXED); // read unlocked by windowHasRoom
+    pthread_cond_broadcast(&chunkWritten);
+    pthread_mutex_unlock(&windowLock);
+  }
+  if (pendingCount > 0 && framedOutput)
+  {
+    writeFrame(&pendingCount, &pendingChar, 1, NULL);
+  }
+  else if (pendingCount > 0)
+  {
+    writeRunToStdout(pendingCount, pendingChar);
+  }
+  fflush(stdout);
+}
 
-  } while (!(isComplete == 1 && queueSize == 0));
+// parses a byte count with an optional K or M suffix, e.g. 256K or 4M; 0 if invalid
+int parseSize(char *arg)
+{
+  char *end;
+  long size = strtol(arg, &end, 10);
+  if (*end == 'K' || *end == 'k')
+  {
+    size <<= 10;
+    end++;
+  }
+  else if (*end == 'M' || *end == 'm')
+  {
+    size <<= 20;
+    end++;
+  }
+  if (*end != '\0' || size <= 0 || size > (1 << 30))
+  {
+    return 0;
+  }
+  return size;
+}
 
-  return NULL;
+// parses a plain count from 1 to max, with no suffix; 0 if invalid
+int parseCount(char *arg, int max)
+{
+  char *end;
+  long count = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || count <= 0 || count > max)
+  {
+    return 0;
+  }
+  return count;
 }
 
-void writeCompressedOutput()
+// parses a list of CPUs like 0-3,8,10-11 into cpuList; 0 if invalid
+int parseCpuList(char *arg)
 {
-  char *output = malloc(totalPages * pageSize * (sizeof(int) + sizeof(char)));
-  char *start = output;
-  for (int i = 0; i < totalPages; i++)
+  numCpus = 0;
+  free(cpuList);
+  cpuList = malloc(sizeof(int) * CPU_SETSIZE);
+  char *end = arg;
+  while (*end != '\0' && *end != '\n')
   {
-    if (i < totalPages - 1)
+    long first = strtol(end, &end, 10), last = first;
+    if (*end == '-')
     {
-      if (out[i].data[out[i].size - 1] == out[i + 1].data[0])
+      last = strtol(end + 1, &end, 10);
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE || (*end != ',' && *end != '\0' && *end != '\n'))
+    {
+      return 0;
+    }
+    for (long cpu = first; cpu <= last && numCpus < CPU_SETSIZE; cpu++)
+    {
+      cpuList[numCpus++] = cpu;
+    }
+    end += *end == ',';
+  }
+  return numCpus;
+}
+
+// reads a sysfs list like /sys/devices/system/node/online into cpuList; 0 if there's none
+int readCpuList(char *fileName)
+{
+  char line[4096];
+  FILE *file = fopen(fileName, "r");
+  int ok = file != NULL && fgets(line, sizeof(line), file) != NULL;
+  if (file != NULL)
+  {
+    fclose(file);
+  }
+  return ok ? parseCpuList(line) : 0;
+}
+
+// the CPUs this process may run on, node by node, for NUMA mode without a list of CPUs
+void numaCpuList()
+{
+  cpu_set_t allowed;
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  int *ordered = malloc(sizeof(int) * CPU_SETSIZE);
+  int numOrdered = 0;
+  int numNodes = readCpuList("/sys/devices/system/node/online");
+  int *nodes = malloc(sizeof(int) * (numNodes + 1));
+  memcpy(nodes, cpuList, sizeof(int) * numNodes);
+  for (int n = 0; n < numNodes; n++)
+  {
+    char fileName[64];
+    snprintf(fileName, sizeof(fileName), "/sys/devices/system/node/node%d/cpulist", nodes[n]);
+    int nodeCpus = readCpuList(fileName);
+    for (int i = 0; i < nodeCpus; i++)
+    {
+      if (CPU_ISSET(cpuList[i], &allowed))
       {
-        out[i + 1].count[0] += out[i].count[out[i].size - 1];
-        out[i].size--;
+        ordered[numOrdered++] = cpuList[i];
       }
     }
-    for (int j = 0; j < out[i].size; j++)
+  }
+  // no NUMA information: the allowed CPUs in order
+  for (int cpu = 0; numOrdered == 0 && cpu < CPU_SETSIZE; cpu++)
+  {
+    if (CPU_ISSET(cpu, &allowed))
     {
-      int num = out[i].count[j];
-      char character = out[i].data[j];
-      *((int *)output) = num;
-      output += sizeof(int);
-      *((char *)output) = character;
-      output += sizeof(char);
+      ordered[numOrdered++] = cpu;
     }
   }
-  fwrite(start, output - start, 1, stdout);
+  free(nodes);
+  free(cpuList);
+  cpuList = ordered;
+  numCpus = numOrdered;
+}
+
+// 1 if every CPU in cpuList is one this process may run on
+int cpusAllowed()
+{
+  cpu_set_t allowed;
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  for (int i = 0; cpuList != NULL && i < numCpus; i++)
+  {
+    if (!CPU_ISSET(cpuList[i], &allowed))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// pins the thread about to be created with attr to its CPU in cpuList, if threads are pinned;
+// slot counts producers from 0, and consumers from numProducers
+void pinThread(pthread_attr_t *attr, int slot)
+{
+  pthread_attr_init(attr);
+  if (cpuList == NULL)
+  {
+    return;
+  }
+  int cpu;
+  if (slot < numProducers || numCpus <= numProducers)
+  {
+    cpu = cpuList[slot % numCpus];
+  }
+  else
+  {
+    cpu = cpuList[numProducers + (slot - numProducers) % (numCpus - numProducers)];
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_attr_setaffinity_np(attr, sizeof(set), &set);
 }
 
+// stats every file up front, groups the files, and numbers the chunks of the whole input, so
+// a chunk's place in the output is known in O(1) however many files came before it. Runs
+// of consecutive small files are batched into one chunk of up to chunkSize bytes.
+void statFiles()
+{
+  struct stat pd;
+  size_t smallFileSize = SMALL_FILE_SIZE < chunkSize ? SMALL_FILE_SIZE : chunkSize;
+  groups = malloc(sizeof(struct FileGroup) * numFiles);
+  fileSizes = malloc(sizeof(off_t) * numFiles);
+  numGroups = 0;
+  totalChunks = 0;
+  int batchOpen = 0; // the last group is a batch that later small files may join
+  for (int i = 0; i < numFiles; i++)
+  {
+    // file validation
+    if (stat(fileNames[i], &pd) == -1)
+    {
+      exit(1);
+    }
+
+    fileSizes[i] = pd.st_size;
+    if (pd.st_size == 0)
+    {
+      continue;
+    }
+    if (pd.st_size <= smallFileSize && batchOpen
+        && groups[numGroups - 1].size + pd.st_size <= (size_t)chunkSize)
+    {
+      struct FileGroup *last = &groups[numGroups - 1];
+      last->numFiles = i - last->firstFile + 1;
+      last->size += pd.st_size;
+      continue;
+    }
+
+    struct FileGroup *group = &groups[numGroups++];
+    group->firstFile = i;
+    group->numFiles = 1;
+    group->size = pd.st_size;
+    group->firstChunk = totalChunks;
+    group->batched = pd.st_size <= smallFileSize;
+    batchOpen = group->batched;
+    totalChunks += group->batched ? 1 : (pd.st_size + chunkSize - 1) / chunkSize;
+  }
+}
+
+// pzip_bench.c includes this file to time the kernels; build it with -DPZIP_NO_MAIN
+#ifndef PZIP_NO_MAIN
 int main(int argc, char *argv[])
 {
+  chunkSize = DEFAULT_CHUNK_SIZE;
+  totalTh = get_nprocs() < MAX_THREADS ? get_nprocs() : MAX_THREADS; // set to 4 for mac
+  queueSize = DEFAULT_QUEUE_SIZE;
+  int opt;
+  int badOption = 0;
+
+  // the environment first, so the flags override it
+  char *env;
+  if ((env = getenv("PZIP_THREADS")) != NULL)
+  {
+    badOption |= (totalTh = parseCount(env, MAX_THREADS)) == 0;
+  }
+  if ((env = getenv("PZIP_QUEUE")) != NULL)
+  {
+    badOption |= (queueSize = parseSize(env)) == 0;
+  }
+  if ((env = getenv("PZIP_CPUS")) != NULL)
+  {
+    badOption |= parseCpuList(env) == 0;
+  }
+  if ((env = getenv("PZIP_NUMA")) != NULL)
+  {
+    numaMode = strcmp(env, "") != 0 && strcmp(env, "0") != 0;
+  }
+
+  while ((opt = getopt(argc, argv, "c:fi:t:q:a:n")) != -1)
+  {
+    if (opt == 'c')
+    {
+      badOption |= (chunkSize = parseSize(optarg)) == 0;
+    }
+    else if (opt == 't')
+    {
+      badOption |= (totalTh = parseCount(optarg, MAX_THREADS)) == 0;
+    }
+    else if (opt == 'q')
+    {
+      badOption |= (queueSize = parseSize(optarg)) == 0;
+    }
+    else if (opt == 'a')
+    {
+      badOption |= parseCpuList(optarg) == 0;
+    }
+    else if (opt == 'n')
+    {
+      numaMode = 1;
+    }
+    else if (opt == 'f')
+    {
+      framedOutput = 1;
+    }
+    else if (opt == 'i' && strcmp(optarg, "mmap") == 0)
+    {
+      inputEngine = ENGINE_MMAP;
+    }
+    else if (opt == 'i' && strcmp(optarg, "read") == 0)
+    {
+      inputEngine = ENGINE_READ;
+    }
+    else if (opt == 'i' && strcmp(optarg, "uring") == 0)
+    {
+      inputEngine = ENGINE_URING;
+    }
+    else
+    {
+      badOption = 1;
+    }
+  }
+
   // validate arguments
-  if (argc < 2)
+  if (badOption || optind >= argc || queueSize < 2 || (queueSize & (queueSize - 1)) != 0
+      || queueSize > MAX_QUEUE_SIZE || !cpusAllowed())
   {
-    printf("pzip: file1 [file2 ...]\n");
+    printf("pzip: [-c chunk_size] [-f] [-i mmap|read|uring] [-t threads] [-q queue_depth] [-a cpus] [-n] file1 [file2 ...]\n");
     exit(1);
   }
+  if (numaMode && cpuList == NULL)
+  {
+    numaCpuList();
+  }
 
-  pageSize = sysconf(_SC_PAGE_SIZE);
-  numFiles = argc - 1;
-  totalTh = get_nprocs(); // set to 4 for mac
-  pagesPerFile = malloc(sizeof(int) * numFiles);
+  numFiles = argc - optind;
+  fileNames = argv + optind;
+  chooseKernel();
+  statFiles();
 
-  out = malloc(sizeof(struct Output) * 512000 * 2);
+  // mapping is cheap next to compressing, so a few producers keep the queue full
+  numProducers = totalTh / 4 > 0 ? totalTh / 4 : 1;
+  if (numProducers > numGroups)
+  {
+    numProducers = numGroups > 0 ? numGroups : 1;
+  }
 
-  // producer
-  pthread_t pid, cid[totalTh];
-  pthread_create(&pid, NULL, producer, argv + 1);
+  // enough slots for every consumer to be working ahead while the writer catches up
+  pageSize = sysconf(_SC_PAGE_SIZE);
+  windowSize = queueSize + 2 * totalTh;
+  window = calloc(windowSize, sizeof(struct Output));
+  initQueue();
 
-  // consumer
-  for (int i = 0; i < totalTh; i++)
+  // producers
+  pthread_t *pid = malloc(sizeof(pthread_t) * numProducers);
+  pthread_t *cid = malloc(sizeof(pthread_t) * totalTh);
+  pthread_attr_t attr;
+  for (int i = 0; i < numProducers; i++)
   {
-    pthread_create(&cid[i], NULL, consumer, NULL);
+    pinThread(&attr, i);
+    pthread_create(&pid[i], &attr, producer, NULL);
+    pthread_attr_destroy(&attr);
   }
 
-  // wait for all consumers and producer to finish
+  // consumer, each with a body pool in NUMA mode; the pools outlive the consumers, since the
+  // writer hands buffers back after they're gone
+  struct BodyPool *pools = numaMode ? calloc(totalTh, sizeof(struct BodyPool)) : NULL;
   for (int i = 0; i < totalTh; i++)
   {
-    pthread_join(cid[i], NULL);
+    pinThread(&attr, numProducers + i);
+    pthread_create(&cid[i], &attr, consumer, pools != NULL ? &pools[i] : NULL);
+    pthread_attr_destroy(&attr);
   }
-  pthread_join(pid, NULL);
 
+  // write chunks out as they finish, then wait for all consumers and producers
   writeCompressedOutput();
+  for (int i = 0; i < totalTh; i++)
+  {
+    pthread_join(cid[i], NULL);
+  }
+  for (int i = 0; i < numProducers; i++)
+  {
+    pthread_join(pid[i], NULL);
+  }
+  free(pid);
+  free(cid);
+  free(pools);
 
   return 0;
-}
\ No newline at end of file
+}
+#endif
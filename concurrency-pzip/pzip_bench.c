@@ -0,0 +1,196 @@
+#define PZIP_NO_MAIN
+#include "pzip.c" // first, as it sets _GNU_SOURCE
+#include <time.h>
+
+/*
+
+  Per-kernel throughput of the pzip run scanner.
+
+  Build with:
+    gcc -Wall -O -pthread -o pzip_bench pzip_bench.c
+
+  Usage:
+    ./pzip_bench [size_mb]
+      Compresses size_mb (default 64) of long-run, short-run, text-like and all-same input
+      one chunk at a time with every kernel the CPU supports, prints GB/s of input, and
+      checks that every kernel's output matches the scalar one.
+
+*/
+
+#define BENCH_CHUNK_SIZE (1 << 20)
+#define BENCH_REPEATS 3
+
+struct Kernel
+{
+  char *name;
+  void (*scan)(const char *in, int size, struct RunWriter *w);
+  int supported;
+};
+
+double nowSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// fills the buffer with runs of random characters from alphabet, each 1 to maxRun long
+void fillRuns(char *buf, size_t size, char *alphabet, int maxRun)
+{
+  size_t i = 0;
+  int numChars = strlen(alphabet);
+  while (i < size)
+  {
+    char c = alphabet[rand() % numChars];
+    int run = 1 + rand() % maxRun;
+    for (int j = 0; j < run && i < size; j++)
+    {
+      buf[i++] = c;
+    }
+  }
+}
+
+// words and spaces with the occasional doubled letter, like English text
+void fillText(char *buf, size_t size)
+{
+  static char *words[] = {"the", "of", "and", "to", "in", "a", "is", "that", "for", "it",
+                          "file", "thread", "compress", "parallel", "letter", "all", "will"};
+  int numWords = sizeof(words) / sizeof(words[0]);
+  size_t i = 0;
+  while (i < size)
+  {
+    char *word = words[rand() % numWords];
+    for (int j = 0; word[j] != '\0' && i < size; j++)
+    {
+      buf[i++] = word[j];
+    }
+    if (i < size)
+    {
+      buf[i++] = rand() % 12 == 0 ? '\n' : ' ';
+    }
+  }
+}
+
+// compresses the whole buffer chunk by chunk, returning seconds for the best of the repeats;
+// the outputs of the last repeat are left in outputs
+double timeKernel(struct Kernel *kernel, char *buf, size_t size, struct Output *outputs)
+{
+  double best = 0;
+  int numChunks = (size + BENCH_CHUNK_SIZE - 1) / BENCH_CHUNK_SIZE;
+  scanRuns = kernel->scan;
+  for (int r = 0; r < BENCH_REPEATS; r++)
+  {
+    double start = nowSeconds();
+    for (int i = 0; i < numChunks; i++)
+    {
+      struct Buffer curr;
+      curr.chunkIndex = i;
+      curr.address = buf + (size_t)i * BENCH_CHUNK_SIZE;
+      curr.size = i == numChunks - 1 ? size - (size_t)i * BENCH_CHUNK_SIZE : BENCH_CHUNK_SIZE;
+      if (r > 0)
+      {
+        free(outputs[i].body);
+      }
+      compress(curr, &outputs[i]);
+    }
+    double seconds = nowSeconds() - start;
+    if (r == 0 || seconds < best)
+    {
+      best = seconds;
+    }
+  }
+  return best;
+}
+
+int sameOutputs(struct Output *a, struct Output *b, int numChunks)
+{
+  for (int i = 0; i < numChunks; i++)
+  {
+    if (a[i].numRuns != b[i].numRuns || a[i].bodySize != b[i].bodySize
+        || a[i].firstCount != b[i].firstCount || a[i].firstChar != b[i].firstChar
+        || a[i].lastCount != b[i].lastCount || a[i].lastChar != b[i].lastChar
+        || memcmp(a[i].body, b[i].body, a[i].bodySize) != 0)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void freeOutputs(struct Output *outputs, int numChunks)
+{
+  for (int i = 0; i < numChunks; i++)
+  {
+    free(outputs[i].body);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 64) << 20;
+  if (size == 0)
+  {
+    printf("pzip_bench: [size_mb]\n");
+    exit(1);
+  }
+  int numChunks = (size + BENCH_CHUNK_SIZE - 1) / BENCH_CHUNK_SIZE;
+
+  struct Kernel kernels[] = {
+    {"scalar", scanRunsScalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+    {"sse2", scanRunsSse2, __builtin_cpu_supports("sse2")},
+    {"avx2", scanRunsAvx2, __builtin_cpu_supports("avx2")},
+#endif
+  };
+  int numKernels = sizeof(kernels) / sizeof(kernels[0]);
+  char *inputs[] = {"long-runs", "short-runs", "text", "all-same"};
+  int numInputs = sizeof(inputs) / sizeof(inputs[0]);
+
+  char *buf = malloc(size);
+  struct Output *expected = malloc(numChunks * sizeof(struct Output));
+  struct Output *outputs = malloc(numChunks * sizeof(struct Output));
+  srand(1);
+  printf("%-12s %-8s %10s %10s %6s\n", "input", "kernel", "seconds", "GB/s", "check");
+  for (int in = 0; in < numInputs; in++)
+  {
+    if (in == 0)
+    {
+      fillRuns(buf, size, "abcdefgh", 2000);
+    }
+    else if (in == 1)
+    {
+      fillRuns(buf, size, "ab", 3);
+    }
+    else if (in == 2)
+    {
+      fillText(buf, size);
+    }
+    else
+    {
+      memset(buf, 'z', size);
+    }
+
+    for (int k = 0; k < numKernels; k++)
+    {
+      if (!kernels[k].supported)
+      {
+        printf("%-12s %-8s %10s\n", inputs[in], kernels[k].name, "unsupported");
+        continue;
+      }
+      struct Output *results = k == 0 ? expected : outputs;
+      double seconds = timeKernel(&kernels[k], buf, size, results);
+      int ok = k == 0 || sameOutputs(expected, outputs, numChunks);
+      printf("%-12s %-8s %10.4f %10.2f %6s\n", inputs[in], kernels[k].name, seconds,
+             size / seconds / 1e9, ok ? "ok" : "WRONG");
+      if (k > 0)
+      {
+        freeOutputs(outputs, numChunks);
+      }
+    }
+    freeOutputs(expected, numChunks);
+  }
+  free(buf);
+  free(expected);
+  free(outputs);
+  return 0;
+}
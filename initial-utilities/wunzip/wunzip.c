@@ -1,5 +1,90 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// header of the framed format written by wzip -f; see wzip.c for the layout
+const char framed_magic[8] = {0, 0, 0, 0, 'W', 'Z', 'V', '1'};
+
+void corrupt_input()
+{
+    printf("wunzip: corrupt input\n");
+    exit(1);
+}
+
+// bytes left in the frame being decoded
+unsigned long long frame_left = 0;
+
+// reads the next byte of the current frame
+int frame_byte(FILE *input_file)
+{
+    int c = fgetc(input_file);
+    if (c == EOF || frame_left == 0)
+    {
+        corrupt_input();
+    }
+    frame_left--;
+    return c;
+}
+
+// reads a little-endian base 128 varint, taking its bytes from the current frame if in_frame
+unsigned long long read_varint(FILE *input_file, int in_frame)
+{
+    unsigned long long value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int c = in_frame ? frame_byte(input_file) : fgetc(input_file);
+        if (c == EOF)
+        {
+            corrupt_input();
+        }
+        value |= (unsigned long long)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0)
+        {
+            return value;
+        }
+    }
+    corrupt_input();
+    return 0;
+}
+
+void wunzip_framed(FILE *input_file)
+{
+    int c;
+    while ((c = fgetc(input_file)) != EOF)
+    {
+        ungetc(c, input_file);
+        frame_left = read_varint(input_file, 0);
+        unsigned long long decoded_bytes = read_varint(input_file, 0);
+
+        // the decoded size isn't needed when decoding front to back, only checked
+        unsigned long long decoded = 0;
+        while (frame_left > 0)
+        {
+            unsigned long long token = read_varint(input_file, 1);
+            unsigned long long length = token >> 1;
+            if (token & 1)
+            {
+                for (unsigned long long j = 0; j < length; j++)
+                {
+                    putchar(frame_byte(input_file));
+                }
+            }
+            else
+            {
+                c = frame_byte(input_file);
+                for (unsigned long long j = 0; j < length; j++)
+                {
+                    putchar(c);
+                }
+            }
+            decoded += length;
+        }
+        if (decoded != decoded_bytes)
+        {
+            corrupt_input();
+        }
+    }
+}
 
 void wunzip_file(FILE *input_file)
 {
@@ -10,6 +95,15 @@ void wunzip_file(FILE *input_file)
         exit(1);
     }
 
+    // files starting with the framed header use the framed format, others the [int][char] one
+    char header[sizeof(framed_magic)];
+    if (fread(header, sizeof(header), 1, input_file) == 1 && memcmp(header, framed_magic, sizeof(header)) == 0)
+    {
+        wunzip_framed(input_file);
+        return;
+    }
+    rewind(input_file);
+
     int run_length = 0;
     int current_char = 0;
 
@@ -1,9 +1,119 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+/*
+ * Framed format (-f): an 8-byte header, then frames of tokens.
+ *
+ *   header: 00 00 00 00 'W' 'Z' 'V' '1' (a legacy file never starts with a zero count)
+ *   frame:  [varint payload bytes][varint decoded bytes][tokens]
+ *   token:  varint v; if v is even, a run of v >> 1 copies of the byte that follows,
+ *           if v is odd, a literal block of the v >> 1 raw bytes that follow
+ *
+ * Varints are little-endian base 128. Runs shorter than MIN_RUN go into literal blocks.
+ * A literal block's header is always written as two varint bytes, so it can be filled in
+ * once the block ends; that caps blocks at LITERAL_MAX bytes. Frames let a decoder find
+ * where every frame's output goes without decoding the tokens.
+ */
+
+#define FRAME_SIZE (1 << 16)
+#define MIN_RUN 3
+#define LITERAL_MAX 8191
+
+const char framed_magic[8] = {0, 0, 0, 0, 'W', 'Z', 'V', '1'};
+int framed = 0;
+
+unsigned char frame[FRAME_SIZE + 64];
+size_t frame_len = 0;
+unsigned long long frame_decoded = 0;
+size_t literal_start = 0; // offset of the open literal block's header in frame
+size_t literal_len = 0; // 0 if no literal block is open
+
+void put_varint(unsigned char *buf, size_t *len, unsigned long long value)
+{
+    while (value >= 0x80)
+    {
+        buf[(*len)++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buf[(*len)++] = value;
+}
+
+void close_literal()
+{
+    if (literal_len > 0)
+    {
+        unsigned int value = (literal_len << 1) | 1;
+        frame[literal_start] = (value & 0x7f) | 0x80;
+        frame[literal_start + 1] = value >> 7;
+        literal_len = 0;
+    }
+}
+
+void flush_frame(FILE *output_file)
+{
+    close_literal();
+    if (frame_len > 0)
+    {
+        unsigned char header[20];
+        size_t header_len = 0;
+        put_varint(header, &header_len, frame_len);
+        put_varint(header, &header_len, frame_decoded);
+        fwrite(header, header_len, 1, output_file);
+        fwrite(frame, frame_len, 1, output_file);
+    }
+    frame_len = 0;
+    frame_decoded = 0;
+}
+
+void write_framed_run(int count, int c, FILE *output_file)
+{
+    if (count >= MIN_RUN)
+    {
+        close_literal();
+        put_varint(frame, &frame_len, (unsigned long long)count << 1);
+        frame[frame_len++] = c;
+    }
+    else
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (literal_len == 0 || literal_len == LITERAL_MAX)
+            {
+                close_literal();
+                literal_start = frame_len;
+                frame_len += 2;
+            }
+            frame[frame_len++] = c;
+            literal_len++;
+        }
+    }
+    frame_decoded += count;
+    if (frame_len >= FRAME_SIZE)
+    {
+        flush_frame(output_file);
+    }
+}
+
+// write the current_char and length to output in whichever format was chosen
+void write_run(int count, int c, FILE *output_file)
+{
+    if (framed)
+    {
+        write_framed_run(count, c, output_file);
+        return;
+    }
+    fwrite(&count, sizeof(int), 1, output_file);
+    fputc(c, output_file);
+}
 
 void wzip_files(int argc, char** argv)
 {
     FILE *output_file = stdout;
+    if (framed)
+    {
+        fwrite(framed_magic, sizeof(framed_magic), 1, output_file);
+    }
 
     int prev_char = -1;
     int count = 0;
@@ -38,8 +148,7 @@ void wzip_files(int argc, char** argv)
             // if character changes, write current char and length to output
             else
             {
-                fwrite(&count, sizeof(int), 1, output_file);
-                fputc(prev_char, output_file);
+                write_run(count, prev_char, output_file);
                 prev_char = current_char;
                 count = 1;
             }
@@ -49,14 +158,33 @@ void wzip_files(int argc, char** argv)
     }
     
     // write the current_char and length to output when EOF of last file is reached
-    fwrite(&count, sizeof(int), 1, output_file);
-    fputc(prev_char, output_file);
+    if (framed)
+    {
+        // the framed format has no record for empty input
+        if (count > 0)
+        {
+            write_run(count, prev_char, output_file);
+        }
+        flush_frame(output_file);
+    }
+    else
+    {
+        write_run(count, prev_char, output_file);
+    }
 
     fclose(output_file);
 }
 
 int main(int argc, char *argv[])
 {
+    // -f picks the framed format
+    if (argc > 1 && strcmp(argv[1], "-f") == 0)
+    {
+        framed = 1;
+        argc--;
+        argv++;
+    }
+
     // if no files specified, exit with 1
     if (argc < 2)
     {
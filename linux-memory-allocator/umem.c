@@ -4,23 +4,226 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
+#include <stdint.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 #include "umem.h"
 
+// SEGREGATED keeps free blocks in per-class lists: 16-byte steps up to SMALL_LIMIT, then
+// one class per power of two. A block sits in the largest class not above its size, so
+// any block in a class at or above the request's rounded-up class fits it without a search.
+#define SMALL_LIMIT (512)
+#define NUM_SMALL_CLASSES (SMALL_LIMIT / 16)
+#define NUM_CLASSES (64)
+
+// BUDDY splits the region into power-of-two blocks, aligned to their size from heapStart.
+// A block of order o spans 1 << o bytes, header included, and keeps its order in the header
+// as a MemBlock size, so ufree checks it like any other block. Free blocks sit in
+// classLists[o]. The buddy bitmap has one bit per pair of buddies, the XOR of whether each
+// is a free block; freeing a block that flips its pair's bit to 0 means its buddy is free.
+#define MIN_ORDER (5)
+
+// With THREAD_SAFE, each thread caches freed blocks of up to SMALL_LIMIT bytes in per-size
+// lists of its own, and umalloc and ufree on those sizes touch nothing else, so they take no
+// lock. A thread fills an empty list with CACHE_BATCH blocks at a time from the heap, and
+// hands CACHE_BATCH back once a list holds more than CACHE_LIMIT, both under heapLock.
+// Cached blocks still look allocated to the heap, and only their payload changes while
+// cached, so the heap never races with a cache. Their prev link is set to CACHE_KEY, so ufree
+// only has to search its cache for a block that has it.
+#define CACHE_BATCH (16)
+#define CACHE_LIMIT (32)
+
+// Every block starts with boundary tags: its own size, and the size of the block just
+// before it, which doubles as that block's footer. Both carry an ALLOCATED bit (sizes are
+// multiples of 16), so ufree can find and check both physical neighbours in O(1). A free
+// block keeps its free list links in its payload, so the lists are doubly linked for free.
+// The region ends with a header-only allocated block, so the last block has a neighbour.
 typedef struct MemBlock
 {
-    size_t size;
-    struct MemBlock *next;
+    size_t prevSize;       // footer of the previous block: its size and ALLOCATED bit
+    size_t size;           // bytes of payload, with ALLOCATED in bit 0
+    struct MemBlock *next; // free blocks only
+    struct MemBlock *prev; // free blocks only
 } MemBlock;
 
+#define ALLOCATED ((size_t)1)
+#define HEADER_SIZE (offsetof(MemBlock, next))
+#define MIN_PAYLOAD (sizeof(MemBlock) - HEADER_SIZE)
+
 MemBlock *freeList;      // pointer to head of free list
 MemBlock *lastAllocated; // pointer to last allocated block for NEXT_FIT
 int allocationAlgo;      // current allocation algorithm
 int allocationFlag = 0;  // 0 = umeminit not called yet, 1 = umeminit called
+char *heapStart;         // the region from umeminit
+char *heapEnd;
+
+MemBlock *classLists[NUM_CLASSES]; // SEGREGATED: free blocks by size class, BUDDY: by order
+uint64_t nonEmptyClasses;          // bit c is set if classLists[c] has a block
+int topOrder;                      // BUDDY: the order of the block covering the whole region
+unsigned char *buddyBits;          // BUDDY: the pair bitmap, kept past heapEnd
+
+int threadSafe;                                         // umeminit was given THREAD_SAFE
+pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;   // THREAD_SAFE: guards all of the above
+pthread_key_t cacheKey;                                 // THREAD_SAFE: flushes a thread's cache as it exits
+pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+
+typedef struct ThreadCache
+{
+    MemBlock *lists[NUM_SMALL_CLASSES]; // blocks of (c + 1) * 16 bytes or more, linked by next
+    int counts[NUM_SMALL_CLASSES];
+    int registered; // cacheKey is set, so the cache is flushed when the thread exits
+} ThreadCache;
+
+__thread ThreadCache cache;
+
+#define CACHE_KEY ((MemBlock *)&cacheKey)
+
+static inline size_t blockSize(MemBlock *block)
+{
+    return block->size & ~ALLOCATED;
+}
+
+static inline MemBlock *nextBlock(MemBlock *block)
+{
+    return (MemBlock *)((char *)block + HEADER_SIZE + blockSize(block));
+}
+
+static inline MemBlock *prevBlock(MemBlock *block)
+{
+    return (MemBlock *)((char *)block - HEADER_SIZE - (block->prevSize & ~ALLOCATED));
+}
+
+// writes a block's header and the footer that follows it
+static inline void setTags(MemBlock *block, size_t size, size_t allocated)
+{
+    block->size = size | allocated;
+    nextBlock(block)->prevSize = size | allocated;
+}
+
+// bytes a block must have to be in class c
+size_t classSize(int c)
+{
+    if (c < NUM_SMALL_CLASSES)
+        return (size_t)(c + 1) * 16;
+    return (size_t)1 << (c - NUM_SMALL_CLASSES + 10);
+}
+
+// the class a free block of this size goes in: the largest class not above size
+int floorClass(size_t size)
+{
+    if (size <= SMALL_LIMIT)
+        return size / 16 - 1;
+    if (size < 1024)
+        return NUM_SMALL_CLASSES - 1;
+    int c = NUM_SMALL_CLASSES + (63 - __builtin_clzll(size)) - 10;
+    return c < NUM_CLASSES ? c : NUM_CLASSES - 1;
+}
+
+// the first class all of whose blocks fit a request of this size
+int ceilClass(size_t size)
+{
+    if (size <= SMALL_LIMIT)
+        return size / 16 - 1;
+    int c = NUM_SMALL_CLASSES + (64 - __builtin_clzll(size - 1)) - 10;
+    return c < NUM_CLASSES ? c : NUM_CLASSES - 1;
+}
 
-void splitBlock(size_t size, size_t remainingSize, MemBlock *currBlock);
+// the order of a buddy block with this much payload
+static inline int blockOrder(size_t size)
+{
+    return 63 - __builtin_clzll(size + HEADER_SIZE);
+}
+
+static inline int usesClassLists()
+{
+    return allocationAlgo == SEGREGATED || allocationAlgo == BUDDY;
+}
+
+// the class list a free block of this size belongs on
+static inline int classOf(size_t size)
+{
+    return allocationAlgo == BUDDY ? blockOrder(size) : floorClass(size);
+}
+
+// the list a free block of this size belongs on
+static inline MemBlock **listFor(size_t size)
+{
+    return usesClassLists() ? &classLists[classOf(size)] : &freeList;
+}
+
+void insertFree(MemBlock *block)
+{
+    MemBlock **list = listFor(blockSize(block));
+    block->prev = NULL;
+    block->next = *list;
+    if (*list != NULL)
+        (*list)->prev = block;
+    *list = block;
+    if (usesClassLists())
+        nonEmptyClasses |= (uint64_t)1 << classOf(blockSize(block));
+}
+
+void removeFree(MemBlock *block)
+{
+    MemBlock **list = listFor(blockSize(block));
+    if (block->prev != NULL)
+        block->prev->next = block->next;
+    else
+        *list = block->next;
+    if (block->next != NULL)
+        block->next->prev = block->prev;
+    if (usesClassLists() && *list == NULL)
+        nonEmptyClasses &= ~((uint64_t)1 << classOf(blockSize(block)));
+
+    // NEXT_FIT's roving pointer moves on past a block that leaves the list
+    if (lastAllocated == block)
+        lastAllocated = block->next;
+}
+
+// takes size bytes from a free block, giving back what's left if it makes a block of its own;
+// returns the payload
+void *allocateBlock(MemBlock *block, size_t size)
+{
+    size_t remainingSize = blockSize(block) - size;
+    if (remainingSize < HEADER_SIZE + MIN_PAYLOAD)
+    {
+        removeFree(block);
+        setTags(block, blockSize(block), ALLOCATED);
+        return (char *)block + HEADER_SIZE;
+    }
+
+    // the block after this one is allocated, so the remainder has nothing to merge with
+    MemBlock *remainingBlock = (MemBlock *)((char *)block + HEADER_SIZE + size);
+    if (allocationAlgo != SEGREGATED || floorClass(remainingSize - HEADER_SIZE) == floorClass(blockSize(block)))
+    {
+        // the remainder takes the block's place in its list, so first fit goes on carving the
+        // same block instead of spreading allocations over the region
+        MemBlock **list = listFor(blockSize(block));
+        remainingBlock->next = block->next;
+        remainingBlock->prev = block->prev;
+        if (block->prev != NULL)
+            block->prev->next = remainingBlock;
+        else
+            *list = remainingBlock;
+        if (block->next != NULL)
+            block->next->prev = remainingBlock;
+        setTags(block, size, ALLOCATED);
+        setTags(remainingBlock, remainingSize - HEADER_SIZE, 0);
+    }
+    else
+    {
+        removeFree(block);
+        setTags(block, size, ALLOCATED);
+        setTags(remainingBlock, remainingSize - HEADER_SIZE, 0);
+        insertFree(remainingBlock);
+    }
+    if (allocationAlgo == NEXT_FIT || lastAllocated == block)
+        lastAllocated = remainingBlock;
+    return (char *)block + HEADER_SIZE;
+}
 
 void *bestFitAlgo(size_t size)
 {
@@ -28,8 +231,8 @@ void *bestFitAlgo(size_t size)
     MemBlock *currBlock = freeList;
     size_t smallestSize = (size_t)-1;
 
-    // find smallest block that fits
-    while (currBlock != NULL)
+    // find smallest block that fits, stopping early on an exact fit
+    while (currBlock != NULL && smallestSize != size)
     {
         if (currBlock->size >= size && currBlock->size < smallestSize)
         {
@@ -40,41 +243,7 @@ void *bestFitAlgo(size_t size)
     }
 
     if (bestFitBlock != NULL)
-    {
-        // allocate memory from best fit block
-        lastAllocated = bestFitBlock;
-        void *allocatedMem = (void *)(bestFitBlock + 1) + (sizeof(MemBlock) - 1); // address after block header
-        if (bestFitBlock->size > size)
-        {
-            // create a new block for the remaining free space
-            MemBlock *remainingBlock = (MemBlock *)((char *)bestFitBlock + size + sizeof(MemBlock));
-            remainingBlock->size = bestFitBlock->size - size - sizeof(MemBlock);
-            remainingBlock->next = bestFitBlock->next;
-
-            // update the current best-fit block
-            bestFitBlock->size = size;
-            bestFitBlock->next = remainingBlock;
-        }
-        else
-        {
-            // remove the entire block from the free list
-            if (bestFitBlock == freeList)
-            {
-                freeList = bestFitBlock->next;
-            }
-            else
-            {
-                currBlock = freeList;
-                while (currBlock->next != bestFitBlock)
-                {
-                    currBlock = currBlock->next;
-                }
-                currBlock->next = bestFitBlock->next;
-            }
-        }
-
-        return allocatedMem;
-    }
+        return allocateBlock(bestFitBlock, size);
 
     return NULL;
 }
@@ -97,41 +266,7 @@ void *worstFitAlgo(size_t size)
     }
 
     if (worstFitBlock != NULL)
-    {
-        // allocate memory from worst fit block
-        lastAllocated = worstFitBlock;
-        void *allocatedMem = (void *)(worstFitBlock + 1) + (sizeof(MemBlock) - 1);
-        if (worstFitBlock->size > size)
-        {
-            // create a new block for the remaining free space
-            MemBlock *remainingBlock = (MemBlock *)((char *)worstFitBlock + size + sizeof(MemBlock)); // address after block header
-            remainingBlock->size = worstFitBlock->size - size - sizeof(MemBlock);
-            remainingBlock->next = worstFitBlock->next;
-
-            // update the current worst-fit block
-            worstFitBlock->size = size;
-            worstFitBlock->next = remainingBlock;
-        }
-        else
-        {
-            // remove the entire block from free list
-            if (worstFitBlock == freeList)
-            {
-                freeList = worstFitBlock->next;
-            }
-            else
-            {
-                currBlock = freeList;
-                while (currBlock->next != worstFitBlock)
-                {
-                    currBlock = currBlock->next;
-                }
-                currBlock->next = worstFitBlock->next;
-            }
-        }
-
-        return allocatedMem;
-    }
+        return allocateBlock(worstFitBlock, size);
 
     return NULL;
 }
@@ -139,39 +274,12 @@ void *worstFitAlgo(size_t size)
 void *firstFitAlgo(size_t size)
 {
     MemBlock *currBlock = freeList;
-    MemBlock *prevBlock = NULL;
 
     // find first block in free list that is large enough
     while (currBlock != NULL)
     {
         if (currBlock->size >= size)
-        {
-            // allocate memory from found block
-            void *allocatedMem = (void *)(currBlock + 1) + (sizeof(MemBlock) - 1); // address after block header
-
-            // check if block needs to be split
-            size_t remainingSize = currBlock->size - size;
-            if (remainingSize >= sizeof(MemBlock))
-            {
-                splitBlock(size, remainingSize, currBlock);
-            }
-            else
-            {
-                // remove block from the free list
-                if (prevBlock == NULL)
-                {
-                    freeList = currBlock->next;
-                }
-                else
-                {
-                    prevBlock->next = currBlock->next;
-                }
-            }
-
-            return allocatedMem;
-        }
-
-        prevBlock = currBlock;
+            return allocateBlock(currBlock, size);
         currBlock = currBlock->next;
     }
 
@@ -180,51 +288,133 @@ void *firstFitAlgo(size_t size)
 
 void *nextFitAlgo(size_t size)
 {
-    // start search from last allocated request
-    MemBlock *currBlock = lastAllocated;
-    MemBlock *prevBlock = NULL;
+    // start search from where the last allocation left off
+    MemBlock *startBlock = lastAllocated != NULL ? lastAllocated : freeList;
+    MemBlock *currBlock = startBlock;
 
-    // find block, then same as first_fit
+    // find block, wrapping around to the head of the free list once
     while (currBlock != NULL)
     {
         if (currBlock->size >= size)
         {
-            // allocate memory from found block
-            void *allocatedMem = (void *)((char *)(currBlock + 1) + ((sizeof(MemBlock) - 1) & ~(sizeof(MemBlock) - 1)));
-
-            // check if the block needs to be split
-            size_t remainingSize = currBlock->size - size;
-            if (remainingSize >= sizeof(MemBlock))
-            {
-                splitBlock(size, remainingSize, currBlock);
-            }
-            else
-            {
-                // remove the block from the free list
-                if (prevBlock == NULL)
-                {
-                    freeList = currBlock->next;
-                }
-                else
-                {
-                    prevBlock->next = currBlock->next;
-                }
-            }
             lastAllocated = currBlock->next;
-
-            return allocatedMem;
+            return allocateBlock(currBlock, size);
         }
 
-        prevBlock = currBlock;
-        currBlock = currBlock->next;
+        currBlock = currBlock->next != NULL ? currBlock->next : freeList;
+        if (currBlock == startBlock)
+            break;
+    }
+
+    return NULL;
+}
+
+void *segregatedAlgo(size_t size)
+{
+    int c = ceilClass(size);
+    uint64_t candidates = nonEmptyClasses & (~(uint64_t)0 << c);
 
-        // if end of free list reached, wrap around to head of free list
-        if (currBlock == NULL)
-            currBlock = freeList;
+    if (candidates != 0 && classSize(c) >= size)
+    {
+        // the smallest non-empty class that fits; one bit scan, however many blocks are free
+        return allocateBlock(classLists[__builtin_ctzll(candidates)], size);
+    }
+
+    // no class is sure to fit, but blocks in the request's own class may: look through it
+    for (MemBlock *currBlock = classLists[floorClass(size)]; currBlock != NULL; currBlock = currBlock->next)
+    {
+        if (currBlock->size >= size)
+            return allocateBlock(currBlock, size);
+    }
+
+    return NULL;
+}
+
+// flips the bit of the pair the block of this order at this offset belongs to, and returns
+// the new bit. Pairs are numbered like a heap: the pair splitting the whole region is 1, and
+// the children of pair n are 2n and 2n + 1.
+static inline int toggleBuddyBit(size_t offset, int order)
+{
+    size_t pair = ((size_t)1 << (topOrder - order - 1)) + (offset >> (order + 1));
+    buddyBits[pair >> 3] ^= 1 << (pair & 7);
+    return (buddyBits[pair >> 3] >> (pair & 7)) & 1;
+}
+
+void *buddyAlgo(size_t size)
+{
+    int order = 64 - __builtin_clzll(size + HEADER_SIZE - 1);
+    if (order < MIN_ORDER)
+        order = MIN_ORDER;
+    if (order > topOrder)
+        return NULL;
+
+    // the smallest free block of at least that order
+    uint64_t candidates = nonEmptyClasses & (~(uint64_t)0 << order);
+    if (candidates == 0)
+        return NULL;
+    int o = __builtin_ctzll(candidates);
+    MemBlock *block = classLists[o];
+    removeFree(block);
+    size_t offset = (char *)block - heapStart;
+    if (o < topOrder)
+        toggleBuddyBit(offset, o);
+
+    // split it down, freeing the upper half each time
+    while (o > order)
+    {
+        o--;
+        MemBlock *buddy = (MemBlock *)((char *)block + ((size_t)1 << o));
+        buddy->size = ((size_t)1 << o) - HEADER_SIZE;
+        insertFree(buddy);
+        toggleBuddyBit(offset, o);
+    }
+
+    block->size = (((size_t)1 << order) - HEADER_SIZE) | ALLOCATED;
+    return (char *)block + HEADER_SIZE;
+}
+
+// frees a buddy block, merging it with its buddy for as long as the buddy is free too
+void buddyFree(MemBlock *block)
+{
+    size_t offset = (char *)block - heapStart;
+    int order = blockOrder(blockSize(block));
+    block->size = blockSize(block); // so freeing it again fails, even once it's inside a merged block
+
+    while (order < topOrder && toggleBuddyBit(offset, order) == 0)
+    {
+        removeFree((MemBlock *)(heapStart + (offset ^ ((size_t)1 << order))));
+        offset &= ~((size_t)1 << order);
+        order++;
     }
 
-    // call first fit once pointers are set
-    return firstFitAlgo(size);
+    block = (MemBlock *)(heapStart + offset);
+    block->size = ((size_t)1 << order) - HEADER_SIZE;
+    insertFree(block);
+}
+
+// lays the buddy tree over the region and the pair bitmap at its end. The tree covers the
+// next power of two up, and the part of it past heapEnd is never free, so nothing merges into it.
+void buddyInit(size_t sizeOfRegion)
+{
+    topOrder = 64 - __builtin_clzll(sizeOfRegion - 1);
+    size_t bitmapSize = ((size_t)1 << (topOrder - MIN_ORDER)) / 8 + 1;
+    size_t managedSize = (sizeOfRegion - bitmapSize) & ~(((size_t)1 << MIN_ORDER) - 1);
+    heapEnd = heapStart + managedSize;
+    buddyBits = (unsigned char *)heapEnd;
+
+    // start with every block allocated, which leaves every bit 0, then free the largest
+    // aligned blocks that tile the managed part
+    size_t offset = 0;
+    while (managedSize - offset >= ((size_t)1 << MIN_ORDER))
+    {
+        int order = offset == 0 ? topOrder : __builtin_ctzll(offset);
+        while (((size_t)1 << order) > managedSize - offset)
+            order--;
+        MemBlock *block = (MemBlock *)(heapStart + offset);
+        block->size = (((size_t)1 << order) - HEADER_SIZE) | ALLOCATED;
+        buddyFree(block);
+        offset += (size_t)1 << order;
+    }
 }
 
 int umeminit(size_t sizeOfRegion, int allocAlgo)
@@ -242,25 +432,39 @@ int umeminit(size_t sizeOfRegion, int allocAlgo)
         return -1;
     close(fd);
 
-    // initalize memory region and data structures
-    freeList = (MemBlock *)mem;
-    freeList->size = sizeOfRegion - sizeof(MemBlock);
-    freeList->next = NULL;
     // set allocation vars
     allocationFlag = 1;
-    allocationAlgo = allocAlgo;
+    threadSafe = (allocAlgo & THREAD_SAFE) != 0;
+    allocationAlgo = allocAlgo & ~THREAD_SAFE;
+    heapStart = (char *)mem;
+    heapEnd = heapStart + sizeOfRegion;
+
+    freeList = NULL;
+    lastAllocated = NULL;
+    if (allocationAlgo == BUDDY)
+    {
+        buddyInit(sizeOfRegion);
+        return 0;
+    }
+
+    // initalize memory region and data structures: one free block, then the end marker,
+    // with nothing before the first block to merge with
+    MemBlock *firstBlock = (MemBlock *)mem;
+    firstBlock->prevSize = ALLOCATED;
+    setTags(firstBlock, sizeOfRegion - 2 * HEADER_SIZE, 0);
+    nextBlock(firstBlock)->size = ALLOCATED;
+    insertFree(firstBlock);
 
     return 0;
 }
 
-void *umalloc(size_t size)
+// allocates size bytes, already rounded, from the heap itself
+void *heapAlloc(size_t size)
 {
-    if (size <= 0 || allocationFlag == 0)
-        return NULL;
-
-    size = (size + 7) & (~7);
     switch (allocationAlgo)
     {
+    case SEGREGATED:
+        return segregatedAlgo(size);
     case BEST_FIT:
         return bestFitAlgo(size);
     case WORST_FIT:
@@ -269,39 +473,138 @@ void *umalloc(size_t size)
         return firstFitAlgo(size);
     case NEXT_FIT:
         return nextFitAlgo(size);
-    // case BUDDY:
+    case BUDDY:
+        return buddyAlgo(size);
     default:
         break;
     }
     return NULL;
 }
 
-void splitBlock(size_t size, size_t remainingSize, MemBlock *currBlock)
+// merges a block that has just been freed with whichever physical neighbours are free; each
+// neighbour is found from the boundary tags and unlinked in O(1). Returns the merged block.
+MemBlock *coalesce(MemBlock *block)
 {
-    MemBlock *newBlock = (MemBlock *)((char *)currBlock + size + sizeof(MemBlock));
-    newBlock->size = remainingSize - sizeof(MemBlock);
-    newBlock->next = currBlock->next;
-    currBlock->size = size;
-    currBlock->next = newBlock;
+    size_t size = blockSize(block);
+    block->size = size; // so freeing it again fails, even once it's inside a merged block
+
+    MemBlock *next = nextBlock(block);
+    if (!(next->size & ALLOCATED))
+    {
+        removeFree(next);
+        size += HEADER_SIZE + blockSize(next);
+    }
+    if (!(block->prevSize & ALLOCATED))
+    {
+        MemBlock *prev = prevBlock(block);
+        removeFree(prev);
+        size += HEADER_SIZE + blockSize(prev);
+        block = prev;
+    }
+
+    setTags(block, size, 0);
+    return block;
 }
 
-void coalesce()
+// returns a block that ufree has checked to the heap itself
+void heapFree(MemBlock *block)
 {
-    MemBlock *currBlock = freeList;
+    if (allocationAlgo == BUDDY)
+        buddyFree(block);
+    else
+        insertFree(coalesce(block));
+}
 
-    // iterate through free list and coalesce neighboring free blocks
-    while (currBlock != NULL)
+// hands the first count blocks of a cache list back to the heap
+void flushCache(ThreadCache *threadCache, int c, int count)
+{
+    pthread_mutex_lock(&heapLock);
+    while (count-- > 0 && threadCache->lists[c] != NULL)
     {
-        MemBlock *nextBlock = currBlock->next;
+        MemBlock *block = threadCache->lists[c];
+        threadCache->lists[c] = block->next;
+        threadCache->counts[c]--;
+        heapFree(block);
+    }
+    pthread_mutex_unlock(&heapLock);
+}
 
-        if (nextBlock != NULL && (char *)currBlock + currBlock->size + sizeof(MemBlock) == (char *)nextBlock)
-        {
-            // coalesce current block with next block
-            currBlock->size += nextBlock->size + sizeof(MemBlock);
-            currBlock->next = nextBlock->next;
-        }
-        currBlock = currBlock->next;
+// cacheKey's destructor: a thread that exits gives all of its cached blocks back
+void releaseCache(void *threadCache)
+{
+    for (int c = 0; c < NUM_SMALL_CLASSES; c++)
+        flushCache(threadCache, c, ((ThreadCache *)threadCache)->counts[c]);
+}
+
+void createCacheKey()
+{
+    pthread_key_create(&cacheKey, releaseCache);
+}
+
+static inline void pushCache(MemBlock *block, int c)
+{
+    block->prev = CACHE_KEY;
+    block->next = cache.lists[c];
+    cache.lists[c] = block;
+    cache.counts[c]++;
+}
+
+// fills an empty cache list with blocks of size bytes from the heap
+void refillCache(int c, size_t size)
+{
+    if (!cache.registered)
+    {
+        pthread_once(&cacheKeyOnce, createCacheKey);
+        pthread_setspecific(cacheKey, &cache);
+        cache.registered = 1;
+    }
+
+    pthread_mutex_lock(&heapLock);
+    for (int i = 0; i < CACHE_BATCH; i++)
+    {
+        void *ptr = heapAlloc(size);
+        if (ptr == NULL)
+            break;
+        pushCache((MemBlock *)((char *)ptr - HEADER_SIZE), c);
+    }
+    pthread_mutex_unlock(&heapLock);
+}
+
+void *umalloc(size_t size)
+{
+    if (size <= 0 || allocationFlag == 0)
+        return NULL;
+
+    // 16-byte steps keep blocks aligned and leave bit 0 of the size for the ALLOCATED tag
+    size = (size + 15) & (~15);
+    if (!threadSafe)
+        return heapAlloc(size);
+
+    // buddy blocks come in fewer sizes; ask for the one the heap will hand out anyway, so
+    // blocks go back to the cache list they came from
+    if (allocationAlgo == BUDDY && size + HEADER_SIZE > ((size_t)1 << MIN_ORDER))
+        size = ((size_t)1 << (64 - __builtin_clzll(size + HEADER_SIZE - 1))) - HEADER_SIZE;
+
+    if (size > SMALL_LIMIT)
+    {
+        pthread_mutex_lock(&heapLock);
+        void *ptr = heapAlloc(size);
+        pthread_mutex_unlock(&heapLock);
+        return ptr;
+    }
+
+    int c = size / 16 - 1;
+    if (cache.lists[c] == NULL)
+    {
+        refillCache(c, size);
+        if (cache.lists[c] == NULL)
+            return NULL;
     }
+    MemBlock *block = cache.lists[c];
+    cache.lists[c] = block->next;
+    cache.counts[c]--;
+    block->prev = NULL;
+    return (char *)block + HEADER_SIZE;
 }
 
 int ufree(void *ptr)
@@ -309,22 +612,157 @@ int ufree(void *ptr)
     if (ptr == NULL || allocationFlag == 0)
         return 0;
 
-    MemBlock *blockToFree = (MemBlock *)ptr - 1;
+    MemBlock *blockToFree = (MemBlock *)((char *)ptr - HEADER_SIZE);
+
+    // check that region is not invalid, and that the block is allocated. An allocated block's
+    // header only changes when it's freed, so this needs no lock.
+    if ((char *)blockToFree < heapStart || (char *)ptr >= heapEnd || ((uintptr_t)ptr & 15) != 0
+        || !(blockToFree->size & ALLOCATED) || blockSize(blockToFree) > (size_t)(heapEnd - (char *)ptr))
+    {
+        return -1;
+    }
+
+    if (allocationAlgo == BUDDY)
+    {
+        // a buddy block must also start where a block of its order can
+        size_t blockBytes = blockSize(blockToFree) + HEADER_SIZE;
+        if ((blockBytes & (blockBytes - 1)) != 0 || (((char *)blockToFree - heapStart) & (blockBytes - 1)) != 0)
+            return -1;
+    }
+
+    if (!threadSafe)
+    {
+        heapFree(blockToFree);
+        return 0;
+    }
+
+    if (blockSize(blockToFree) > SMALL_LIMIT)
+    {
+        pthread_mutex_lock(&heapLock);
+        heapFree(blockToFree);
+        pthread_mutex_unlock(&heapLock);
+        return 0;
+    }
+
+    // a block freed twice in a row is still in this thread's cache
+    int c = blockSize(blockToFree) / 16 - 1;
+    if (blockToFree->prev == CACHE_KEY)
+    {
+        for (MemBlock *currBlock = cache.lists[c]; currBlock != NULL; currBlock = currBlock->next)
+        {
+            if (currBlock == blockToFree)
+                return -1;
+        }
+    }
+    pushCache(blockToFree, c);
+    if (cache.counts[c] > CACHE_LIMIT)
+        flushCache(&cache, c, CACHE_BATCH);
+
+    return 0;
+}
+
+// A pool hands out objects of one size from slabs it gets from umalloc: a page, or more if
+// that would hold fewer than SLAB_MIN_OBJECTS. Objects have no header. A free object holds the
+// link of the pool's free list in its first word, and a slab is carved by bumping a pointer
+// until it's used up, so upoolalloc and upoolfree are each a few loads and stores. Slabs go
+// back to the heap only when the pool is destroyed. A pool is not thread-safe on its own.
+#define SLAB_MIN_OBJECTS (8)
+
+typedef struct Slab
+{
+    struct Slab *next;   // the pool's slabs, for upooldestroy
+    size_t padding;      // keeps objects 16-byte aligned when their size allows
+} Slab;
+
+struct UPool
+{
+    size_t objectSize;
+    size_t slabSize;   // what upoolalloc asks umalloc for
+    void *freeObjects; // freed objects, linked through their first word
+    char *bump;        // the unused part of the newest slab
+    char *bumpEnd;
+    Slab *slabs;
+};
+
+UPool *upoolcreate(size_t objectSize)
+{
+    if (objectSize <= 0 || allocationFlag == 0)
+        return NULL;
+
+    UPool *pool = umalloc(sizeof(UPool));
+    if (pool == NULL)
+        return NULL;
+
+    // room for the free list link, and aligned like a pointer
+    pool->objectSize = (objectSize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    // whole pages, header included; under BUDDY a power of two of them, all of the block
+    // umalloc would hand out anyway
+    size_t slabPages = (HEADER_SIZE + sizeof(Slab) + SLAB_MIN_OBJECTS * pool->objectSize + getpagesize() - 1)
+                       / getpagesize();
+    if (allocationAlgo == BUDDY && slabPages > 1)
+        slabPages = (size_t)1 << (64 - __builtin_clzll(slabPages - 1));
+    pool->slabSize = slabPages * getpagesize() - HEADER_SIZE;
+    pool->freeObjects = NULL;
+    pool->bump = NULL;
+    pool->bumpEnd = NULL;
+    pool->slabs = NULL;
+    return pool;
+}
+
+void *upoolalloc(UPool *pool)
+{
+    void *object = pool->freeObjects;
+    if (object != NULL)
+    {
+        pool->freeObjects = *(void **)object;
+        return object;
+    }
 
-    // check that region is not invalid
-    if ((char *)blockToFree < (char *)freeList || (char *)blockToFree >= (char *)freeList + freeList->size) {
-        return -1;  
+    if ((size_t)(pool->bumpEnd - pool->bump) < pool->objectSize)
+    {
+        Slab *slab = umalloc(pool->slabSize);
+        if (slab == NULL)
+            return NULL;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->bump = (char *)(slab + 1);
+        pool->bumpEnd = (char *)slab + pool->slabSize;
     }
 
-    // set block to free list
-    blockToFree->next = freeList;
-    freeList = blockToFree;
+    object = pool->bump;
+    pool->bump += pool->objectSize;
+    return object;
+}
 
-    coalesce();
+int upoolfree(UPool *pool, void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
 
+    // objects carry no header, so all there is to check is that it's in the region
+    if ((char *)ptr < heapStart || (char *)ptr >= heapEnd)
+        return -1;
+
+    *(void **)ptr = pool->freeObjects;
+    pool->freeObjects = ptr;
     return 0;
 }
 
+void upooldestroy(UPool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    while (pool->slabs != NULL)
+    {
+        Slab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        ufree(slab);
+    }
+    ufree(pool);
+}
+
 void umemdump()
 {
     if (allocationFlag == 0)
@@ -333,6 +771,9 @@ void umemdump()
         return;
     }
 
+    if (threadSafe)
+        pthread_mutex_lock(&heapLock);
+
     MemBlock *currBlock = freeList;
 
     while (currBlock != NULL)
@@ -340,4 +781,21 @@ void umemdump()
         printf("Free Block: Address=%p, Size=%zu\n", (void *)currBlock, currBlock->size);
         currBlock = currBlock->next;
     }
+
+    for (int c = 0; c < NUM_CLASSES; c++)
+    {
+        for (currBlock = classLists[c]; currBlock != NULL; currBlock = currBlock->next)
+            printf("Free Block: Class=%zu, Address=%p, Size=%zu\n",
+                   allocationAlgo == BUDDY ? (size_t)1 << c : classSize(c), (void *)currBlock, currBlock->size);
+    }
+
+    // only this thread's cache; other threads' cached blocks are theirs to touch
+    for (int c = 0; c < NUM_SMALL_CLASSES; c++)
+    {
+        for (currBlock = cache.lists[c]; currBlock != NULL; currBlock = currBlock->next)
+            printf("Cached Block: Address=%p, Size=%zu\n", (void *)currBlock, blockSize(currBlock));
+    }
+
+    if (threadSafe)
+        pthread_mutex_unlock(&heapLock);
 }
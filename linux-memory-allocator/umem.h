@@ -8,10 +8,22 @@
 #define FIRST_FIT 					(3)
 #define NEXT_FIT 					(4)
 #define BUDDY						(5)
+#define SEGREGATED					(6)
+
+// OR into the allocation algorithm to make umalloc and ufree safe to call from any thread
+#define THREAD_SAFE					(256)
 
 int 	umeminit(size_t sizeOfRegion, int allocationAlgo);
 void 	*umalloc(size_t size);
 int 	ufree(void *ptr);
 void 	umemdump();
 
+// fixed-size object pools, carved out of the umeminit region in page-sized slabs
+typedef struct UPool UPool;
+
+UPool 	*upoolcreate(size_t objectSize);
+void 	*upoolalloc(UPool *pool);
+int 	upoolfree(UPool *pool, void *ptr);
+void 	upooldestroy(UPool *pool);
+
 #endif
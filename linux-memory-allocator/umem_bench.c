@@ -0,0 +1,352 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "umem.h"
+
+/*
+
+  Benchmarks for umem.
+
+  Build with:
+    gcc -Wall -O2 -pthread -o umem_bench umem_bench.c umem.c
+
+  Usage:
+    ./umem_bench frag [ops]
+      Fragmentation over time: runs ops (default 2000000) random allocations and frees of
+      mixed sizes against each policy, and every tenth of the way prints the bytes in use,
+      the largest block umalloc can still hand out, the fragmentation (how far that falls
+      short of the free bytes) and the share of allocations that failed.
+    ./umem_bench threads [ops] [max_threads]
+      Scaling with THREAD_SAFE: for 1 to max_threads (default the number of CPUs) threads,
+      each thread runs ops (default 2000000) random allocations and frees of its own, and
+      prints the time per operation and the total operations per second.
+    ./umem_bench pool [ops] [object_size]
+      Fixed-size objects (default 24 bytes) from umalloc against a pool, for each policy: the
+      time per allocation or free over ops (default 2000000) of them, and the bytes of the
+      region each object takes up, from how many fit.
+
+  umeminit can only be called once per process, so each policy runs in its own child.
+
+*/
+
+#define REGION_SIZE (16 << 20)
+#define NUM_SLOTS (6000)
+#define NUM_SAMPLES (10)
+#define THREAD_SLOTS (1000)
+#define POOL_SLOTS (REGION_SIZE / 8)
+
+struct Policy
+{
+    char *name;
+    int algo;
+};
+
+struct Policy policies[] = {
+    {"best", BEST_FIT},
+    {"worst", WORST_FIT},
+    {"first", FIRST_FIT},
+    {"next", NEXT_FIT},
+    {"buddy", BUDDY},
+    {"segregated", SEGREGATED},
+};
+int numPolicies = sizeof(policies) / sizeof(policies[0]);
+
+double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// mostly small requests, some medium, a few large, like a typical heap
+size_t randomSize(unsigned *seed)
+{
+    int r = rand_r(seed) % 100;
+    if (r < 70)
+        return 16 + rand_r(seed) % 240;
+    if (r < 95)
+        return 256 + rand_r(seed) % 3840;
+    return 4096 + rand_r(seed) % 61440;
+}
+
+// the largest request umalloc can satisfy right now, found by binary search
+size_t largestFree()
+{
+    size_t lo = 0, hi = REGION_SIZE;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo + 1) / 2;
+        void *ptr = umalloc(mid);
+        if (ptr != NULL)
+        {
+            ufree(ptr);
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+void fragBench(struct Policy *policy, long ops)
+{
+    static void *slots[NUM_SLOTS];
+    static size_t sizes[NUM_SLOTS];
+    size_t live = 0;
+    long allocs = 0, failed = 0;
+    double elapsed = 0;
+    unsigned seed = 1;
+
+    if (umeminit(REGION_SIZE, policy->algo) != 0)
+    {
+        printf("umem_bench: umeminit failed\n");
+        exit(1);
+    }
+    for (int sample = 1; sample <= NUM_SAMPLES; sample++)
+    {
+        double start = nowSeconds();
+        for (long op = 0; op < ops / NUM_SAMPLES; op++)
+        {
+            int i = rand_r(&seed) % NUM_SLOTS;
+            if (slots[i] != NULL)
+            {
+                ufree(slots[i]);
+                slots[i] = NULL;
+                live -= sizes[i];
+                continue;
+            }
+            sizes[i] = randomSize(&seed);
+            slots[i] = umalloc(sizes[i]);
+            allocs++;
+            if (slots[i] == NULL)
+                failed++;
+            else
+                live += sizes[i];
+        }
+        elapsed += nowSeconds() - start;
+
+        size_t largest = largestFree();
+        double fragmentation = 1 - (double)largest / (REGION_SIZE - live);
+        printf("%-10s %10ld %10zu %12zu %7.1f%% %7.2f%% %8.0f\n", policy->name, ops / NUM_SAMPLES * sample,
+               live >> 10, largest >> 10, fragmentation * 100, allocs ? failed * 100.0 / allocs : 0,
+               elapsed * 1e9 / (ops / NUM_SAMPLES * sample));
+        fflush(stdout);
+    }
+}
+
+struct Worker
+{
+    pthread_t thread;
+    unsigned seed;
+    long ops;
+    long failed;
+};
+
+void *threadWorker(void *arg)
+{
+    struct Worker *worker = arg;
+    void *slots[THREAD_SLOTS] = {NULL};
+
+    for (long op = 0; op < worker->ops; op++)
+    {
+        int i = rand_r(&worker->seed) % THREAD_SLOTS;
+        if (slots[i] != NULL)
+        {
+            ufree(slots[i]);
+            slots[i] = NULL;
+            continue;
+        }
+        slots[i] = umalloc(randomSize(&worker->seed));
+        if (slots[i] == NULL)
+            worker->failed++;
+    }
+    for (int i = 0; i < THREAD_SLOTS; i++)
+        ufree(slots[i]);
+    return NULL;
+}
+
+void threadBench(struct Policy *policy, long ops, int numThreads)
+{
+    struct Worker workers[numThreads];
+    long failed = 0;
+
+    if (umeminit(REGION_SIZE * 4, policy->algo | THREAD_SAFE) != 0)
+    {
+        printf("umem_bench: umeminit failed\n");
+        exit(1);
+    }
+
+    double start = nowSeconds();
+    for (int t = 0; t < numThreads; t++)
+    {
+        workers[t] = (struct Worker){.seed = t + 1, .ops = ops};
+        pthread_create(&workers[t].thread, NULL, threadWorker, &workers[t]);
+    }
+    for (int t = 0; t < numThreads; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+        failed += workers[t].failed;
+    }
+    double elapsed = nowSeconds() - start;
+
+    printf("%-10s %8d %12ld %8.0f %10.2f %7.2f%%\n", policy->name, numThreads, ops * numThreads,
+           elapsed * 1e9 / ops, ops * numThreads / elapsed / 1e6, failed * 100.0 / (ops * numThreads));
+}
+
+// allocates objects until the region is full and returns the region bytes each one took up,
+// leaving them in slots
+double fillObjects(void **slots, void *(*alloc)(void *), void *arg, long *count)
+{
+    for (*count = 0; *count < POOL_SLOTS && (slots[*count] = alloc(arg)) != NULL; (*count)++)
+        ;
+    return (double)REGION_SIZE / *count;
+}
+
+// ns per operation of ops allocations and frees, NUM_SLOTS allocations at a time, each batch
+// freed in a shuffled order
+double churnObjects(void **slots, long ops, void *(*alloc)(void *), int (*release)(void *, void *), void *arg)
+{
+    static int order[NUM_SLOTS];
+    unsigned seed = 1;
+    for (int i = 0; i < NUM_SLOTS; i++)
+        order[i] = i;
+    for (int i = NUM_SLOTS - 1; i > 0; i--)
+    {
+        int j = rand_r(&seed) % (i + 1), swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+
+    long rounds = ops / (2 * NUM_SLOTS) + 1;
+    double start = nowSeconds();
+    for (long round = 0; round < rounds; round++)
+    {
+        for (int i = 0; i < NUM_SLOTS; i++)
+            slots[i] = alloc(arg);
+        for (int i = 0; i < NUM_SLOTS; i++)
+            release(arg, slots[order[i]]);
+    }
+    return (nowSeconds() - start) * 1e9 / (rounds * 2 * NUM_SLOTS);
+}
+
+void *umallocObject(void *objectSize)
+{
+    return umalloc(*(size_t *)objectSize);
+}
+
+int ufreeObject(void *objectSize, void *ptr)
+{
+    return ufree(ptr);
+}
+
+void *poolObject(void *pool)
+{
+    return upoolalloc(pool);
+}
+
+int poolFreeObject(void *pool, void *ptr)
+{
+    return upoolfree(pool, ptr);
+}
+
+void poolBench(struct Policy *policy, long ops, int objectSize)
+{
+    void **slots = calloc(POOL_SLOTS, sizeof(void *));
+    size_t size = objectSize;
+    long count;
+
+    if (slots == NULL || umeminit(REGION_SIZE, policy->algo) != 0)
+    {
+        printf("umem_bench: umeminit failed\n");
+        exit(1);
+    }
+
+    double mallocNs = churnObjects(slots, ops, umallocObject, ufreeObject, &size);
+    double mallocBytes = fillObjects(slots, umallocObject, &size, &count);
+    for (long i = 0; i < count; i++)
+        ufree(slots[i]);
+
+    UPool *pool = upoolcreate(objectSize);
+    double poolNs = churnObjects(slots, ops, poolObject, poolFreeObject, pool);
+    double poolBytes = fillObjects(slots, poolObject, pool, &count);
+    upooldestroy(pool);
+
+    printf("%-10s %8d %12.1f %10.1f %12.1f %10.1f\n", policy->name, objectSize, mallocBytes, mallocNs, poolBytes,
+           poolNs);
+    free(slots);
+}
+
+void usage()
+{
+    printf("umem_bench: frag [ops] | threads [ops] [max_threads] | pool [ops] [object_size]\n");
+    exit(1);
+}
+
+// runs a benchmark in a child, since umeminit can only be called once per process
+void runChild(struct Policy *policy, void (*bench)(struct Policy *, long, int), long ops, int numThreads)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        bench(policy, ops, numThreads);
+        exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        printf("%-10s crashed\n", policy->name);
+}
+
+void fragChild(struct Policy *policy, long ops, int numThreads)
+{
+    fragBench(policy, ops);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || (strcmp(argv[1], "frag") != 0 && strcmp(argv[1], "threads") != 0 && strcmp(argv[1], "pool") != 0))
+        usage();
+    long ops = argc > 2 ? atol(argv[2]) : 2000000;
+    if (ops < NUM_SAMPLES)
+        usage();
+
+    if (strcmp(argv[1], "threads") == 0)
+    {
+        int maxThreads = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+        if (maxThreads < 1)
+            usage();
+        printf("%-10s %8s %12s %8s %10s %8s\n", "policy", "threads", "ops", "ns/op", "Mops/s", "failed");
+        for (int p = 0; p < numPolicies; p++)
+        {
+            for (int t = 1; t <= maxThreads; t++)
+                runChild(&policies[p], threadBench, ops, t);
+        }
+        return 0;
+    }
+
+    if (strcmp(argv[1], "pool") == 0)
+    {
+        int objectSize = argc > 3 ? atoi(argv[3]) : 24;
+        if (objectSize < 1 || objectSize > 1024)
+            usage();
+        printf("%-10s %8s %12s %10s %12s %10s\n", "policy", "size", "umalloc B", "ns/op", "pool B", "ns/op");
+        for (int p = 0; p < numPolicies; p++)
+            runChild(&policies[p], poolBench, ops, objectSize);
+        return 0;
+    }
+
+    printf("%-10s %10s %10s %12s %8s %8s %8s\n", "policy", "ops", "live KB", "largest KB", "frag", "failed",
+           "ns/op");
+    for (int p = 0; p < numPolicies; p++)
+        runChild(&policies[p], fragChild, ops, 0);
+    return 0;
+}
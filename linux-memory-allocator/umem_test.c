@@ -5,13 +5,56 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "umem.h"
 #include "umem.c"
 
-int main()
+// BUDDY: a block freed into its lower buddy must not be freeable again
+int buddyTest()
 {
+    printf("Buddy test\n");
+    if (umeminit(4096, BUDDY) == -1)
+    {
+        fprintf(stderr, "umeminit failed.\n");
+        return 1;
+    }
+
+    // split blocks until two 32-byte buddies come out
+    char *blocks[4];
+    char *lower = NULL, *upper = NULL;
+    for (int i = 0; i < 4; i++)
+    {
+        blocks[i] = umalloc(16);
+        if (i > 0 && blocks[i] == blocks[i - 1] + 32 && (blocks[i - 1] - HEADER_SIZE - heapStart) % 64 == 0)
+        {
+            lower = blocks[i - 1];
+            upper = blocks[i];
+        }
+    }
+    printf("ufree lower: %d\n", ufree(lower));
+    printf("ufree upper: %d\n", ufree(upper));
+    int again = ufree(upper);
+    printf("ufree upper: %d\n", again);
+
+    // the merged block must only be handed out once
+    char *small = umalloc(16);
+    char *large = umalloc(48);
+    umemdump();
+    if (again != -1 || small == NULL || large == NULL || (small + 16 > large && large + 48 > small))
+    {
+        fprintf(stderr, "buddy double free not caught.\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "buddy") == 0)
+        return buddyTest();
+
     /*
     //umeminit(4 * 1024 * 1024, BEST_FIT);
     //umeminit(4 * 1024 * 1024, NEXT_FIT);